@@ -5,255 +5,5250 @@
 #include <fstream>
 #include <vector>
 #include <queue>
+#include <unordered_map>
+#include <iterator>
+#include <limits>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <type_traits>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <sys/resource.h>
+#include <ctime>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 using namespace std;
 
-struct CountNode{
-    int count;
-    CountNode* left;
-    CountNode* right;
+/*
+* Writes an unsigned integer to a stream in little-endian byte order.
+* @param output The stream to write to.
+* @param value The value to write.
+* @param bytes The number of low-order bytes of value to write.
+*/
+void writeInt(ostream& output, uint64_t value, int bytes){
+    for (int i = 0; i < bytes; i++){
+        output.put(char((value >> (8 * i)) & 0xFF));
+    }
+}
+
+/*
+* Reads an unsigned little-endian integer from a stream.
+* @param input The stream to read from.
+* @param bytes The number of bytes to read.
+* @return The value read, or 0 for any bytes past the end of the stream.
+*/
+uint64_t readInt(istream& input, int bytes){
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++){
+        int next = input.get();
+        if (next == EOF) break;
+        value |= uint64_t(next & 0xFF) << (8 * i);
+    }
+    return value;
+}
+
+/*
+* Reads an unsigned little-endian integer from memory.
+* @param data The first byte of the integer.
+* @param bytes The number of bytes to read.
+* @return The value read.
+*/
+uint64_t readInt(const unsigned char* data, int bytes){
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++){
+        value |= uint64_t(data[i]) << (8 * i);
+    }
+    return value;
+}
+
+/*
+* Appends an unsigned integer to a byte buffer in little-endian byte order.
+* @param output The buffer to append to.
+* @param value The value to write.
+* @param bytes The number of low-order bytes of value to write.
+*/
+void writeInt(vector<unsigned char>& output, uint64_t value, int bytes){
+    for (int i = 0; i < bytes; i++){
+        output.push_back((value >> (8 * i)) & 0xFF);
+    }
+}
+
+/*
+* Converts a word loaded from memory in host byte order to its big-endian value, or back.
+* @param word The loaded word.
+* @return The word with its bytes in big-endian order.
+*/
+inline uint64_t bigEndian(uint64_t word){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return word;
+#else
+    return __builtin_bswap64(word);
+#endif
+}
+
+/*
+* Continues a CRC-32C (Castagnoli) over a buffer with a slicing-by-8 table: 8 bytes per step through 8 lookups.
+* @param data The bytes to add.
+* @param size The number of bytes in data.
+* @param crc The checksum of the bytes before data.
+* @return The checksum including data.
+*/
+uint32_t crc32cSoftware(const unsigned char* data, size_t size, uint32_t crc){
+    static const array<array<uint32_t, 256>, 8> tables = []{
+        array<array<uint32_t, 256>, 8> tables;
+        for (uint32_t i = 0; i < 256; i++){
+            uint32_t entry = i;
+            for (int bit = 0; bit < 8; bit++){
+                entry = (entry >> 1) ^ (0x82F63B78 & (0 - (entry & 1)));
+            }
+            tables[0][i] = entry;
+        }
+        for (int table = 1; table < 8; table++){
+            for (int i = 0; i < 256; i++){
+                tables[table][i] = (tables[table - 1][i] >> 8) ^ tables[0][tables[table - 1][i] & 0xFF];
+            }
+        }
+        return tables;
+    }();
+    crc = ~crc;
+    for (; size >= 8; data += 8, size -= 8){
+        uint64_t word = readInt(data, 8) ^ crc;
+        crc = 0;
+        for (int i = 0; i < 8; i++){
+            crc ^= tables[7 - i][(word >> (8 * i)) & 0xFF];
+        }
+    }
+    for (; size > 0; data++, size--){
+        crc = (crc >> 8) ^ tables[0][(crc ^ *data) & 0xFF];
+    }
+    return ~crc;
+}
+
+// crc32c() uses the CRC32 instructions of SSE 4.2 (checked once at run time) or of ARMv8 (when compiled for them)
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_HARDWARE __attribute__((target("sse4.2")))
+#define CRC32C_WORD(crc, word) __builtin_ia32_crc32di(crc, word)
+#define CRC32C_BYTE(crc, byte) __builtin_ia32_crc32qi(crc, byte)
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC32C_HARDWARE
+#define CRC32C_WORD(crc, word) __crc32cd(crc, word)
+#define CRC32C_BYTE(crc, byte) __crc32cb(crc, byte)
+#endif
+
+#ifdef CRC32C_HARDWARE
+/*
+* Like crc32cSoftware(), with one instruction per 8 bytes. Needs a CPU with CRC32 instructions.
+*/
+CRC32C_HARDWARE
+uint32_t crc32cHardware(const unsigned char* data, size_t size, uint32_t crc){
+    uint64_t state = uint32_t(~crc);
+    for (; size >= 8; data += 8, size -= 8){
+        uint64_t word;
+        memcpy(&word, data, 8); // the instruction takes the bytes in memory order on little-endian hosts
+        state = CRC32C_WORD(state, word);
+    }
+    uint32_t tail = state;
+    for (; size > 0; data++, size--){
+        tail = CRC32C_BYTE(tail, *data);
+    }
+    return ~tail;
+}
+#endif
+
+/*
+* Computes the CRC-32C (Castagnoli) of a buffer, the checksum of the header and the blocks of an encoded file.
+* @param data The bytes to check.
+* @param size The number of bytes in data.
+* @param crc The checksum of the bytes before data, to continue it; 0 to start a new one.
+* @return The checksum of all the bytes.
+*/
+uint32_t crc32c(const unsigned char* data, size_t size, uint32_t crc = 0){
+#if defined(__GNUC__) && defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    return hardware ? crc32cHardware(data, size, crc) : crc32cSoftware(data, size, crc);
+#elif defined(CRC32C_HARDWARE) && (!defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    return crc32cHardware(data, size, crc);
+#else
+    return crc32cSoftware(data, size, crc);
+#endif
+}
+
+/*
+* Packs variable-length codes MSB-first into a preallocated buffer, padded to whole 64-bit words.
+* Codes collect in a 64-bit accumulator. After every code the accumulator is stored as 8 big-endian bytes
+* and the output advances by the number of whole bytes in it, so writing never branches on how full it is.
+* The destination needs 8 bytes of slack past the padded end for that last store; see capacity().
+*/
+struct BitWriter{
+    unsigned char* start; // first byte of the stream
+    unsigned char* output; // next byte not yet complete
+    uint64_t buffer = 0; // pending bits, filled from the most significant end
+    int used = 0; // number of bits in buffer; at most 7 between writes
+
+    BitWriter(unsigned char* destination = nullptr){
+        start = output = destination;
+    }
+
+    /*
+    * Computes how many bytes a destination needs for a stream.
+    * @param bits The number of bits that will be written.
+    * @return The padded size of the stream plus the slack for the final store.
+    */
+    static size_t capacity(uint64_t bits){
+        return (bits + 63) / 64 * 8 + 8;
+    }
+
+    /*
+    * Adds a code to the accumulator without storing it.
+    * Precondition: used + length <= 63, which holds for up to 56 bits after a flush().
+    * @param value The bits to write; bits above length must be zero.
+    * @param length The number of bits to write (at least 1).
+    */
+    void add(uint64_t value, int length){
+        used += length;
+        buffer |= value << (64 - used);
+    }
+
+    /*
+    * Stores the accumulator and keeps only the bits of its last incomplete byte.
+    */
+    void flush(){
+        uint64_t word = bigEndian(buffer);
+        memcpy(output, &word, 8);
+        output += used >> 3;
+        buffer <<= used & ~7;
+        used &= 7;
+    }
+
+    /*
+    * Appends the low length bits of value to the stream.
+    * @param value The bits to write; bits above length must be zero.
+    * @param length The number of bits to write (1-56).
+    */
+    void write(uint64_t value, int length){
+        add(value, length);
+        flush();
+    }
+
+    /*
+    * Completes the last byte and pads the stream with zero bits to a whole number of 64-bit words.
+    * @return The size of the stream in bytes.
+    */
+    size_t finish(){
+        flush();
+        output += (used + 7) >> 3;
+        size_t bytes = output - start;
+        size_t padded = (bytes + 7) / 8 * 8;
+        memset(output, 0, padded - bytes);
+        output = start + padded;
+        buffer = 0;
+        used = 0;
+        return padded;
+    }
+};
+
+/*
+* Reads an MSB-first bitstream through a 64-bit reservoir.
+* Bits past the end of the data read as zero.
+*/
+struct BitReader{
+    const unsigned char* data;
+    size_t size;
+    size_t position = 0; // next byte to load into the reservoir
+    uint64_t reservoir = 0; // unread bits, aligned to the most significant end
+    int count = 0; // number of valid bits in reservoir
+
+    BitReader(const unsigned char* d = nullptr, size_t n = 0){
+        data = d;
+        size = n;
+    }
+
+    /*
+    * Tops the reservoir up to at least 56 valid bits.
+    */
+    void refill(){
+        if (position + 8 <= size){
+            uint64_t word;
+            memcpy(&word, data + position, 8);
+            word = bigEndian(word);
+            reservoir |= word >> count;
+            position += (63 - count) >> 3;
+            count |= 56;
+            return;
+        }
+        while (count <= 56){
+            uint64_t byte = position < size ? data[position] : 0;
+            reservoir |= byte << (56 - count);
+            position++;
+            count += 8;
+        }
+    }
+
+    /*
+    * Returns the next n bits without consuming them. Call refill() first.
+    * @param n The number of bits to look at (1-56).
+    */
+    uint64_t peek(int n){
+        return reservoir >> (64 - n);
+    }
+
+    /*
+    * Discards the next n bits.
+    * @param n The number of bits to discard (0-56).
+    */
+    void consume(int n){
+        reservoir <<= n;
+        count -= n;
+    }
+};
+
+/*
+* A whole file mapped into memory with mmap.
+* Input files are mapped read-only; output files are created at their final size and mapped writable.
+* Both are advised for sequential access so the kernel reads ahead and drops pages behind the cursor.
+*/
+struct MappedFile{
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    int fd = -1;
+
+    ~MappedFile(){
+        close();
+    }
+
+    /*
+    * Maps an existing file for reading.
+    * @param fileName The name of the file to map.
+    * @return Whether the file was opened; an empty file is opened without a mapping.
+    */
+    bool openRead(const string& fileName){
+        close();
+        fd = ::open(fileName.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0){
+            close();
+            return false;
+        }
+        size = info.st_size;
+        if (size == 0) return true;
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED){
+            close();
+            return false;
+        }
+        data = (unsigned char*)mapping;
+        madvise(data, size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    /*
+    * Creates (or truncates) a file of the given size and maps it for writing.
+    * @param fileName The name of the file to create.
+    * @param fileSize The final size of the file.
+    * @return Whether the file was created and mapped.
+    */
+    bool create(const string& fileName, size_t fileSize){
+        close();
+        fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, fileSize) != 0){
+            close();
+            return false;
+        }
+        size = fileSize;
+        if (size == 0) return true;
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED){
+            close();
+            return false;
+        }
+        data = (unsigned char*)mapping;
+        madvise(data, size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    /*
+    * Unmaps and closes the file. Writes to an output mapping reach the file when it is unmapped.
+    */
+    void close(){
+        if (data) munmap(data, size);
+        if (fd >= 0) ::close(fd);
+        data = nullptr;
+        size = 0;
+        fd = -1;
+    }
+};
+
+/*
+* A bump allocator for scratch memory that is used and dropped together, such as the levels of packageMerge() or the
+* arrays of a Burrows-Wheeler transform. Memory comes from chunks that are kept until the arena is destroyed; a Scope
+* gives back everything allocated since it was opened in O(1), so once an arena has grown to the largest call it serves,
+* further calls allocate nothing from the heap and threads with their own arenas never contend in malloc.
+* Objects are default-constructed but never destroyed, so only trivially destructible types belong in an arena.
+*/
+struct Arena{
+    static constexpr size_t minimumChunk = 64 << 10;
+    struct Chunk{
+        unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+    vector<Chunk> chunks;
+    size_t chunk = 0; // the chunk being allocated from
+    size_t used = 0; // bytes of it in use
+
+    // scratch memory is never shared, so copies of an arena start empty
+    Arena(){}
+    Arena(const Arena&){}
+    Arena& operator=(const Arena&){
+        return *this;
+    }
+
+    /*
+    * Rewinds an arena to where it was when the scope was opened, when the scope closes.
+    */
+    struct Scope{
+        Arena& arena;
+        size_t chunk;
+        size_t used;
+
+        Scope(Arena& owner): arena(owner), chunk(owner.chunk), used(owner.used){}
+        ~Scope(){
+            arena.chunk = chunk;
+            arena.used = used;
+        }
+    };
+
+    /*
+    * @param count The number of objects.
+    * @return Room for count default-constructed objects, valid until the enclosing Scope closes.
+    */
+    template <typename T>
+    T* allocate(size_t count){
+        static_assert(is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        T* objects = (T*)allocateBytes(count * sizeof(T), alignof(T));
+        uninitialized_default_construct_n(objects, count);
+        return objects;
+    }
+
+    /*
+    * @param bytes The number of bytes.
+    * @param alignment Their alignment, a power of 2 no larger than that of new[].
+    * @return Uninitialized memory.
+    */
+    void* allocateBytes(size_t bytes, size_t alignment){
+        for (;; chunk++, used = 0){
+            if (chunk == chunks.size()){
+                // each new chunk is at least as large as all the others together, so chunks stay few
+                size_t capacity = 0;
+                for (const Chunk& existing: chunks){
+                    capacity += existing.size;
+                }
+                size_t size = max({minimumChunk, bytes + alignment, capacity});
+                chunks.push_back({unique_ptr<unsigned char[]>(new unsigned char[size]), size});
+            }
+            size_t start = (used + alignment - 1) & ~(alignment - 1);
+            if (start + bytes <= chunks[chunk].size){
+                used = start + bytes;
+                return chunks[chunk].data.get() + start;
+            }
+        }
+    }
+};
+
+/*
+* A canonical code for one symbol: the low length bits of bits, MSB-first.
+*/
+struct HuffmanCode{
+    uint32_t bits = 0;
+    uint8_t length = 0; // 0 if the symbol is not in the code
+};
+
+/*
+* A multi-level lookup table that resolves a code from several bits at once.
+* The root table is indexed by the next rootBits bits of the stream. Codes longer than that
+* go through a link entry to a second-level table indexed by the following bits (and further
+* levels for very long codes).
+* Each entry is a leaf "(symbol << 8) | length" or a link "linkFlag | (offset << 8) | bits",
+* where length is the number of bits the code uses at that level.
+* The table is built straight from the codes into one flat array; rebuilding it for the next block reuses
+* the memory of the last one, so a decoder allocates nothing per block or per symbol once it has warmed up.
+*/
+struct DecodeTable{
+    static constexpr int maxRootBits = 11;
+    static constexpr uint32_t linkFlag = 0x80000000;
+    static constexpr size_t maxCodes = size_t(1) << 23; // leaves hold code indices in 23 bits
+    vector<uint32_t> entries;
+    vector<uint32_t> order; // scratch for build(): the codes sorted by their bits
+    const uint32_t* mapped = nullptr; // entries of a table used in place (see StaticTable), instead of entries
+    int rootBits = 0;
+    int maxLength = 0; // longest code; if it is at most rootBits, the table has no links
+    int indexBits = maxRootBits; // most bits indexing one level; fewer make a smaller table that follows more links
+
+    /*
+    * Builds the table from a set of prefix-free codes.
+    * @param codes The code of each byte value.
+    */
+    void build(const array<HuffmanCode, 256>& codes){
+        build(codes.data(), codes.size());
+    }
+
+    /*
+    * Builds the table from a set of prefix-free codes; lookups return the index of the matching code.
+    * @param codes The codes; those of length 0 are unused.
+    * @param count The number of codes (at most maxCodes).
+    */
+    void build(const HuffmanCode* codes, size_t count){
+        // sorted by their bits aligned to the left, codes that share a prefix are adjacent. Canonical codes are in
+        // that order when sorted by length, so a counting sort by length suffices unless the check below fails.
+        array<uint32_t, 34> starts{};
+        int maxLength = 0;
+        for (size_t i = 0; i < count; i++){
+            starts[codes[i].length + 1]++;
+            maxLength = max(maxLength, int(codes[i].length));
+        }
+        for (int length = 1; length < 33; length++){
+            starts[length + 1] += starts[length];
+        }
+        uint32_t unused = starts[1]; // codes of length 0
+        order.resize(count - unused);
+        for (size_t i = 0; i < count; i++){
+            if (codes[i].length) order[starts[codes[i].length]++ - unused] = i;
+        }
+        auto aligned = [codes](uint32_t symbol){
+            return uint64_t(codes[symbol].bits) << (32 - codes[symbol].length);
+        };
+        for (size_t i = 1; i < order.size(); i++){
+            if (aligned(order[i - 1]) > aligned(order[i])){
+                sort(order.begin(), order.end(), [&aligned](uint32_t a, uint32_t b){
+                    return aligned(a) < aligned(b) || (aligned(a) == aligned(b) && a < b);
+                });
+                break;
+            }
+        }
+        entries.clear();
+        mapped = nullptr;
+        this->maxLength = maxLength;
+        rootBits = min({maxLength, maxRootBits, max(indexBits, 1)});
+        if (rootBits == 0) return;
+        buildLevel(codes, order.data(), order.size(), 0, rootBits);
+    }
+
+    /*
+    * Fills one table level for codes that share their first depth bits.
+    * @param codes The codes being built into the table.
+    * @param symbols The indices of the codes that share the prefix, sorted by their bits.
+    * @param count The number of indices in symbols.
+    * @param depth The number of bits already resolved by earlier levels.
+    * @param bits The number of bits indexing this level.
+    * @return The offset of the new level in entries.
+    */
+    int buildLevel(const HuffmanCode* codes, const uint32_t* symbols, size_t count, int depth, int bits){
+        int offset = entries.size();
+        entries.resize(offset + (size_t(1) << bits), 0);
+        for (size_t i = 0; i < count;){
+            const HuffmanCode& code = codes[symbols[i]];
+            int remaining = code.length - depth;
+            if (remaining <= bits){
+                uint32_t index = (code.bits & ((uint64_t(1) << remaining) - 1)) << (bits - remaining);
+                uint32_t leaf = (symbols[i] << 8) | remaining;
+                for (uint32_t j = 0; j < (uint32_t(1) << (bits - remaining)); j++){
+                    entries[offset + index + j] = leaf;
+                }
+                i++;
+                continue;
+            }
+            // the longer codes with the same index at this level continue in one deeper level
+            uint32_t index = (code.bits >> (remaining - bits)) & ((uint32_t(1) << bits) - 1);
+            size_t end = i;
+            int longest = 0;
+            for (; end < count; end++){
+                const HuffmanCode& next = codes[symbols[end]];
+                int nextRemaining = next.length - depth;
+                if (nextRemaining <= bits || ((next.bits >> (nextRemaining - bits)) & ((uint32_t(1) << bits) - 1)) != index) break;
+                longest = max(longest, int(next.length));
+            }
+            int subBits = min({longest - depth - bits, maxRootBits, max(indexBits, 1)});
+            int subOffset = buildLevel(codes, symbols + i, end - i, depth + bits, subBits);
+            entries[offset + index] = linkFlag | (uint32_t(subOffset) << 8) | subBits;
+            i = end;
+        }
+        return offset;
+    }
+
+    /*
+    * Decodes one symbol from the stream.
+    * @param reader The stream positioned at the start of a code.
+    * @return The decoded character.
+    */
+    char decodeSymbol(BitReader& reader) const {
+        reader.refill();
+        return lookup(data(), rootBits, reader);
+    }
+
+    /*
+    * @return The entries of the table, wherever they are stored.
+    */
+    const uint32_t* data() const {
+        return mapped ? mapped : entries.data();
+    }
+
+    /*
+    * Decodes one symbol from the bits already in the reservoir, following links into deeper levels as needed.
+    * Codes are at most 32 bits, so one refill always holds a whole code.
+    * Precondition: the reservoir holds at least as many bits as the longest code.
+    * @param entries The entries of a table.
+    * @param rootBits The number of bits indexing its root level.
+    * @param reader The stream positioned at the start of a code.
+    * @return The decoded character.
+    */
+    static char lookup(const uint32_t* entries, int rootBits, BitReader& reader){
+        return char(lookupIndex(entries, rootBits, reader));
+    }
+
+    /*
+    * Like lookup(), specialized for a bound on the code lengths known at compile time.
+    * If MaxLength is at most maxRootBits, the table must have no links (maxLength <= rootBits), so every
+    * lookup is one load and the link test compiles away; otherwise this is lookup().
+    * @param entries The entries of a table whose codes are at most MaxLength bits.
+    * @param rootBits The number of bits indexing its root level.
+    * @param reader The stream positioned at the start of a code.
+    * @return The decoded character.
+    */
+    template <int MaxLength>
+    static char lookup(const uint32_t* entries, int rootBits, BitReader& reader){
+        if constexpr (MaxLength <= maxRootBits){
+            uint32_t entry = entries[reader.peek(rootBits)];
+            reader.consume(entry & 0xFF);
+            return char(entry >> 8);
+        } else {
+            return lookup(entries, rootBits, reader);
+        }
+    }
+
+    /*
+    * Picks the MaxLength to specialize lookups on for this table: the smallest of lengthClasses that bounds its codes,
+    * skipping the classes of at most maxRootBits bits, whose lookups skip the link test, if the table has links.
+    * @return One of lengthClasses.
+    */
+    int lengthClass() const {
+        bool flat = maxLength <= rootBits;
+        for (int bound: lengthClasses){
+            if (maxLength <= bound && (flat || bound > maxRootBits)) return bound;
+        }
+        return lengthClasses[5];
+    }
+
+    // bounds on the longest code that decoders are compiled for; each allows 56 / bound lookups per refill
+    static constexpr int lengthClasses[6] = {8, maxRootBits, 14, 18, 28, 32};
+
+    /*
+    * Like lookup(), for tables built from any number of codes.
+    * @param entries The entries of a table.
+    * @param rootBits The number of bits indexing its root level.
+    * @param reader The stream positioned at the start of a code.
+    * @return The index of the decoded code.
+    */
+    static uint32_t lookupIndex(const uint32_t* entries, int rootBits, BitReader& reader){
+        uint32_t entry = entries[reader.peek(rootBits)];
+        if (entry & linkFlag){
+            int bits = rootBits;
+            do {
+                reader.consume(bits);
+                bits = entry & 0xFF;
+                entry = entries[((entry & ~linkFlag) >> 8) + reader.peek(bits)];
+            } while (entry & linkFlag);
+        }
+        reader.consume(entry & 0xFF);
+        return entry >> 8;
+    }
+};
+
+/*
+* A binary tree over a set of prefix-free codes, for the codes a DecodeTable handles badly: more than
+* DecodeTable::maxCodes of them, or codes so long that the table would need three or more levels (see prefer()).
+* The tree is stored as 4-byte nodes; nodes 2k and 2k + 1 are the children of internal node k, and the root is
+* internal node 0. Each node holds either "leafFlag | index" for a code or the number of the internal node it is,
+* so a complete code of n codes takes 2(n - 1) nodes and builds in one pass over the code bits.
+* A lookup walks one bit per node through a window of the reservoir and consumes the bits once it reaches a leaf.
+*/
+struct DecodeTree{
+    static constexpr uint32_t leafFlag = 0x80000000;
+    vector<uint32_t> nodes;
+    int maxLength = 0; // longest code
+
+    /*
+    * @param count The number of codes.
+    * @param maxLength The longest code.
+    * @return Whether codes like these should be decoded with a DecodeTree rather than a DecodeTable.
+    */
+    static bool prefer(size_t count, int maxLength){
+        return count > DecodeTable::maxCodes || maxLength > 2 * DecodeTable::maxRootBits;
+    }
+
+    /*
+    * Builds the tree from a set of codes; lookups return the index of the matching code.
+    * Bit patterns no code starts with decode as code 0, as they do in a DecodeTable.
+    * @param codes The codes; those of length 0 are unused.
+    * @param count The number of codes (less than 2^31).
+    * @return Whether the codes are prefix-free; they may not be if they were read from corrupt data.
+    */
+    bool build(const HuffmanCode* codes, size_t count){
+        nodes.assign(2, 0); // 0 marks a free node while building; no node refers to the root
+        maxLength = 0;
+        for (size_t i = 0; i < count; i++){
+            int length = codes[i].length;
+            if (length == 0) continue;
+            maxLength = max(maxLength, length);
+            uint32_t internal = 0;
+            for (int depth = 1; depth < length; depth++){
+                uint32_t node = 2 * internal + ((codes[i].bits >> (length - depth)) & 1);
+                if (nodes[node] & leafFlag) return false; // a shorter code is a prefix of this one
+                if (nodes[node] == 0){
+                    nodes[node] = nodes.size() / 2;
+                    nodes.resize(nodes.size() + 2, 0);
+                }
+                internal = nodes[node];
+            }
+            uint32_t node = 2 * internal + (codes[i].bits & 1);
+            if (nodes[node]) return false; // this code is a prefix of another or a duplicate
+            nodes[node] = leafFlag | i;
+        }
+        for (uint32_t& node: nodes){
+            if (node == 0) node = leafFlag;
+        }
+        return true;
+    }
+
+    /*
+    * Decodes one code from the bits already in the reservoir.
+    * Precondition: the reservoir holds at least as many bits as the longest code.
+    * @param nodes The nodes of a tree.
+    * @param reader The stream positioned at the start of a code.
+    * @return The index of the decoded code.
+    */
+    static uint32_t lookupIndex(const uint32_t* nodes, BitReader& reader){
+        uint64_t window = reader.peek(32);
+        uint32_t node = 0;
+        int depth = 0;
+        do {
+            node = nodes[2 * node + ((window >> (31 - depth++)) & 1)];
+        } while (!(node & leafFlag));
+        reader.consume(depth);
+        return node & ~leafFlag;
+    }
+};
+
+// countBytes() is compiled for AVX2 and for the baseline ISA; the loader picks one per CPU at startup
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__ELF__)
+#define HISTOGRAM_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define HISTOGRAM_TARGETS
+#endif
+
+/*
+* Adds the number of occurrences of each byte value in a buffer to counts.
+* Reads 8 bytes per load and spreads them over 4 interleaved sub-histograms, so runs of the same byte
+* do not wait on the previous increment of the same counter. The sub-histograms use 32-bit counters
+* and are merged every 2^30 bytes, before they can overflow.
+* @param data The bytes to count.
+* @param size The number of bytes in data.
+* @param counts Receives the counts, added to what is already there.
+*/
+HISTOGRAM_TARGETS
+void countBytes(const unsigned char* data, size_t size, array<uint64_t, 256>& counts){
+    while (size > 0){
+        size_t chunk = min<size_t>(size, size_t(1) << 30);
+        uint32_t sub[4][256] = {};
+        size_t i = 0;
+        for (; i + 16 <= chunk; i += 16){
+            uint64_t first, second;
+            memcpy(&first, data + i, 8);
+            memcpy(&second, data + i + 8, 8);
+            for (int shift = 0; shift < 64; shift += 16){
+                sub[0][(first >> shift) & 0xFF]++;
+                sub[1][(first >> (shift + 8)) & 0xFF]++;
+                sub[2][(second >> shift) & 0xFF]++;
+                sub[3][(second >> (shift + 8)) & 0xFF]++;
+            }
+        }
+        for (; i < chunk; i++){
+            sub[0][data[i]]++;
+        }
+        for (int j = 0; j < 256; j++){
+            counts[j] += uint64_t(sub[0][j]) + sub[1][j] + sub[2][j] + sub[3][j];
+        }
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+/*
+* Computes optimal code lengths no longer than maxLength with the package-merge algorithm.
+* Each level of the algorithm holds coins of denomination 2^-level: the symbols themselves, merged
+* with packages formed by pairing the cheapest items of the level below. Taking the 2n-2 cheapest items
+* of the top level, every appearance of a symbol (directly or inside a package) adds one bit to its code.
+* Precondition: maxLength is large enough for the number of symbols (2^maxLength >= symbols).
+* @param counts The frequency of each symbol.
+* @param lengths Receives the code length of each symbol; 0 for absent symbols.
+* @param symbols The number of symbols in the alphabet.
+* @param maxLength The longest code allowed.
+* @param scratch Holds the levels while they are needed; 2n-2 items per level for n symbols in use.
+*/
+void packageMerge(const uint64_t* counts, unsigned char* lengths, size_t symbols, int maxLength, Arena& scratch){
+    Arena::Scope scope(scratch);
+    struct Leaf{
+        uint64_t count;
+        int symbol;
+    };
+    size_t n = 0;
+    for (size_t i = 0; i < symbols; i++){
+        n += counts[i] != 0;
+    }
+    Leaf* leaves = scratch.allocate<Leaf>(n);
+    n = 0;
+    for (size_t i = 0; i < symbols; i++){
+        if (counts[i]) leaves[n++] = {counts[i], int(i)};
+    }
+    sort(leaves, leaves + n, [](const Leaf& a, const Leaf& b){
+        return a.count < b.count || (a.count == b.count && a.symbol < b.symbol);
+    });
+    fill(lengths, lengths + symbols, 0);
+    if (n == 0) return;
+    if (n == 1){
+        lengths[leaves[0].symbol] = 1;
+        return;
+    }
+
+    struct Item{
+        uint64_t weight;
+        int leaf; // index into leaves, or -1 for a package
+    };
+    // every level holds at most 2n-2 items, since no more can ever be taken
+    size_t capacity = 2 * n - 2;
+    Item* items = scratch.allocate<Item>(maxLength * capacity);
+    size_t* sizes = scratch.allocate<size_t>(maxLength);
+    for (size_t i = 0; i < n && i < capacity; i++){
+        items[i] = {leaves[i].count, int(i)};
+    }
+    sizes[0] = min(n, capacity);
+    for (int level = 1; level < maxLength; level++){
+        const Item* below = items + (level - 1) * capacity;
+        size_t belowSize = sizes[level - 1];
+        Item* current = items + level * capacity;
+        size_t size = 0;
+        size_t leaf = 0;
+        size_t pair = 0;
+        // merge the leaves with packages of the level below, both already sorted
+        while (size < capacity && (leaf < n || pair + 1 < belowSize)){
+            bool hasPackage = pair + 1 < belowSize;
+            uint64_t packageWeight = hasPackage ? below[pair].weight + below[pair + 1].weight : 0;
+            if (leaf < n && (!hasPackage || leaves[leaf].count <= packageWeight)){
+                current[size++] = {leaves[leaf].count, int(leaf)};
+                leaf++;
+            } else {
+                current[size++] = {packageWeight, -1};
+                pair += 2;
+            }
+        }
+        sizes[level] = size;
+    }
+
+    // expand the selection downwards; selected packages are always a prefix of a level's packages
+    size_t take = capacity;
+    for (int level = maxLength - 1; level >= 0 && take > 0; level--){
+        size_t packages = 0;
+        for (size_t i = 0; i < take && i < sizes[level]; i++){
+            const Item& item = items[level * capacity + i];
+            if (item.leaf >= 0){
+                lengths[leaves[item.leaf].symbol]++;
+            } else {
+                packages++;
+            }
+        }
+        take = 2 * packages;
+    }
+}
+
+/*
+* packageMerge() for byte values.
+*/
+void packageMerge(const array<uint64_t, 256>& counts, array<unsigned char, 256>& lengths, int maxLength, Arena& scratch){
+    packageMerge(counts.data(), lengths.data(), 256, maxLength, scratch);
+}
+
+/*
+* A fixed set of worker threads that run the tasks of one batch at a time.
+* The calling thread works on the batch as worker 0, so a pool of one thread starts no threads at all.
+*/
+struct ThreadPool{
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake; // signals a new batch or shutdown
+    condition_variable done; // signals that every worker finished the batch
+    function<void(size_t, int)> job;
+    size_t taskCount = 0;
+    atomic<size_t> nextTask{0};
+    int running = 0; // workers still in the current batch
+    uint64_t batch = 0; // incremented for every batch
+    bool stopping = false;
+
+    /*
+    * @param threads The total number of threads, including the caller; 0 uses one per hardware thread.
+    */
+    ThreadPool(int threads = 0){
+        if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+        for (int i = 1; i < threads; i++){
+            workers.emplace_back(&ThreadPool::loop, this, i);
+        }
+    }
+    ~ThreadPool(){
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker: workers){
+            worker.join();
+        }
+    }
+
+    /*
+    * @return The number of threads that run tasks, including the caller.
+    */
+    int size() const {
+        return workers.size() + 1;
+    }
+
+    /*
+    * Runs task(i, worker) for every i in [0, count) and returns when all have finished.
+    * @param count The number of tasks.
+    * @param task The function to run; worker identifies the thread so per-thread state can be indexed by it.
+    */
+    void run(size_t count, function<void(size_t task, int worker)> task){
+        if (workers.empty() || count <= 1){
+            for (size_t i = 0; i < count; i++){
+                task(i, 0);
+            }
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            job = task;
+            taskCount = count;
+            nextTask = 0;
+            running = workers.size();
+            batch++;
+        }
+        wake.notify_all();
+        work(0);
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&](){ return running == 0; });
+    }
+
+    /*
+    * Takes tasks from the current batch until none are left.
+    * @param worker The index of the calling thread.
+    */
+    void work(int worker){
+        size_t task;
+        while ((task = nextTask++) < taskCount){
+            job(task, worker);
+        }
+    }
+
+    /*
+    * The body of each worker thread: waits for a batch, works on it and reports back.
+    * @param worker The index of this thread.
+    */
+    void loop(int worker){
+        uint64_t seen = 0;
+        while (true){
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&](){ return stopping || batch != seen; });
+                if (stopping) return;
+                seen = batch;
+            }
+            work(worker);
+            lock_guard<mutex> guard(lock);
+            if (--running == 0) done.notify_one();
+        }
+    }
+};
+
+/*
+* Runs tasks one at a time, in order, on a thread of their own, so that reading or writing a stream overlaps the
+* caller's work. Starting a task waits for the previous one, so a caller that alternates between two buffers can
+* fill one while the other is still being read or written. Without a thread, tasks run in the caller when started.
+*/
+struct BackgroundTask{
+    bool threaded;
+    future<void> pending;
+
+    /*
+    * @param useThread Whether tasks run on a thread of their own.
+    */
+    BackgroundTask(bool useThread): threaded(useThread){}
+    ~BackgroundTask(){
+        wait();
+    }
+
+    /*
+    * Waits for the previous task, then starts a task.
+    * @param task The function to run.
+    */
+    void run(function<void()> task){
+        wait();
+        if (threaded){
+            pending = async(launch::async, move(task));
+        } else {
+            task();
+        }
+    }
+
+    /*
+    * Waits for the last task started, if it is still running.
+    */
+    void wait(){
+        if (pending.valid()) pending.get();
+    }
+};
+
+/*
+* A Huffman tree kept in one contiguous array of at most 2*256-1 nodes and linked by index.
+* Leaves occupy nodes[0, leaves) sorted by count; internal nodes are appended after them. Because
+* internal nodes are created in non-decreasing order of count, the two cheapest nodes are always at the
+* front of either the leaf queue or the internal queue, so the tree is built in linear time without a heap.
+*/
+struct FlatHuffmanTree{
+    struct Node{
+        uint64_t count;
+        int16_t left; // index of the left child, or -1 for a leaf
+        int16_t right; // index of the right child, or the byte value of a leaf
+    };
+    array<Node, 2 * 256 - 1> nodes;
+    int size = 0; // number of nodes in use
+    int leaves = 0; // number of leaves in use
+
+    /*
+    * Rebuilds the tree for a byte histogram, reusing the node array.
+    * @param counts The frequency of each byte value; bytes with a count of 0 get no leaf.
+    */
+    void build(const array<uint64_t, 256>& counts){
+        leaves = 0;
+        for (int i = 0; i < 256; i++){
+            if (counts[i]) nodes[leaves++] = {counts[i], -1, int16_t(i)};
+        }
+        sort(nodes.begin(), nodes.begin() + leaves, [](const Node& a, const Node& b){
+            return a.count < b.count || (a.count == b.count && a.right < b.right);
+        });
+        size = leaves;
+
+        int nextLeaf = 0;
+        int nextInternal = leaves;
+        // takes the cheapest node from the front of either queue
+        auto takeCheapest = [&](){
+            if (nextLeaf < leaves && (nextInternal >= size || nodes[nextLeaf].count <= nodes[nextInternal].count))
+                return nextLeaf++;
+            return nextInternal++;
+        };
+        while (size < 2 * leaves - 1){
+            int right = takeCheapest();
+            int left = takeCheapest();
+            nodes[size++] = {nodes[left].count + nodes[right].count, int16_t(left), int16_t(right)};
+        }
+    }
+
+    /*
+    * Stores the depth of every leaf as its code length.
+    * Internal nodes are visited from the root (the last node) backwards, so parents come before children.
+    * @param lengths Receives the code length of each byte value; 0 for bytes without a leaf.
+    * @return The longest code length.
+    */
+    int codeLengths(array<unsigned char, 256>& lengths) const {
+        lengths.fill(0);
+        if (leaves == 1){
+            lengths[nodes[0].right] = 1; // a lone symbol still needs one bit
+            return 1;
+        }
+        array<int, 2 * 256 - 1> depth;
+        int longest = 0;
+        if (size) depth[size - 1] = 0;
+        for (int i = size - 1; i >= leaves; i--){
+            depth[nodes[i].left] = depth[nodes[i].right] = depth[i] + 1;
+        }
+        for (int i = 0; i < leaves; i++){
+            lengths[nodes[i].right] = depth[i];
+            longest = max(longest, depth[i]);
+        }
+        return longest;
+    }
+};
+
+/*
+* A Huffman tree that adapts to the text as it is coded (the FGK algorithm), so no counting pass or table is needed.
+* The tree starts as a single NYT ("not yet transmitted") leaf. A byte seen for the first time is coded as the NYT
+* code followed by its 9-bit value, and the NYT leaf splits into a new NYT leaf and a leaf for the byte.
+* After every symbol the counts on its path are incremented; before each increment the node is swapped with the
+* highest slot of the same count, which keeps the sibling property (counts never decrease with the slot, and
+* siblings have adjacent slots), so the tree stays a Huffman tree for the counts so far.
+* Encoder and decoder apply the same updates and stay in sync. Nodes live in fixed arrays indexed by slot,
+* like FlatHuffmanTree; the root is the last slot and new leaves are taken from below the NYT leaf.
+*/
+struct AdaptiveHuffmanTree{
+    static constexpr int nyt = 256; // symbol of the NYT leaf
+    static constexpr int endOfStream = 256; // 9-bit value after the NYT code that ends the stream
+    static constexpr int root = 2 * 257 - 2; // slot of the root; 256 byte leaves and the NYT leaf need 2 * 257 - 1 slots
+    array<uint64_t, root + 1> counts;
+    array<int16_t, root + 1> parent;
+    array<int16_t, root + 1> left; // slot of the left child, or -1 for a leaf
+    array<int16_t, root + 1> right; // slot of the right child, or the symbol of a leaf
+    array<int16_t, 257> leafOf; // slot of each symbol's leaf, or -1 if it has not been seen
+
+    AdaptiveHuffmanTree(){
+        reset();
+    }
+
+    /*
+    * Returns the tree to its initial state: a lone NYT leaf.
+    */
+    void reset(){
+        leafOf.fill(-1);
+        counts[root] = 0;
+        parent[root] = -1;
+        left[root] = -1;
+        right[root] = nyt;
+        leafOf[nyt] = root;
+    }
+
+    /*
+    * Appends the code of a byte to a bitstream, then updates the tree for it.
+    * @param symbol The byte value.
+    * @param writer The bitstream to append to.
+    */
+    void write(int symbol, BitWriter& writer){
+        if (leafOf[symbol] < 0){
+            writeEscape(symbol, writer);
+        } else {
+            writePath(leafOf[symbol], writer);
+        }
+        update(symbol);
+    }
+
+    /*
+    * Appends the NYT code and a 9-bit value: a new byte, or endOfStream.
+    * @param value The value to escape.
+    * @param writer The bitstream to append to.
+    */
+    void writeEscape(int value, BitWriter& writer){
+        writePath(leafOf[nyt], writer);
+        writer.write(value, 9);
+    }
+
+    /*
+    * Appends the path from the root to a node, 1 for every right child.
+    * The path is collected from the node upwards in 56-bit pieces, then written from the root down.
+    * @param node The slot of the node.
+    * @param writer The bitstream to append to.
+    */
+    void writePath(int node, BitWriter& writer){
+        uint64_t pieces[5]; // a path has at most 256 edges
+        int full = 0;
+        uint64_t piece = 0;
+        int bits = 0;
+        for (; node != root; node = parent[node]){
+            piece |= uint64_t(right[parent[node]] == node) << bits;
+            if (++bits == 56){
+                pieces[full++] = piece;
+                piece = 0;
+                bits = 0;
+            }
+        }
+        if (bits) writer.write(piece, bits);
+        while (full > 0){
+            writer.write(pieces[--full], 56);
+        }
+    }
+
+    /*
+    * Counts one more occurrence of a symbol, adding a leaf for it if it is new.
+    * @param symbol The byte value; anything else is ignored.
+    */
+    void update(int symbol){
+        if (symbol < 0 || symbol >= nyt) return; // not a byte; leafOf has no slot for it
+        int node = leafOf[symbol];
+        if (node < 0){
+            // the NYT leaf becomes the parent of the new leaf (right) and the new NYT leaf (left)
+            int old = leafOf[nyt];
+            for (int child = old - 2; child < old; child++){
+                counts[child] = 0;
+                parent[child] = old;
+                left[child] = -1;
+            }
+            right[old - 1] = symbol;
+            right[old - 2] = nyt;
+            left[old] = old - 2;
+            right[old] = old - 1;
+            leafOf[symbol] = old - 1;
+            leafOf[nyt] = old - 2;
+            node = old - 1;
+        }
+        while (node != root){
+            int leader = node;
+            while (leader + 1 < root && counts[leader + 1] == counts[node]){
+                leader++;
+            }
+            if (leader != node && leader != parent[node]){
+                swapNodes(node, leader);
+                node = leader;
+            }
+            counts[node]++;
+            node = parent[node];
+        }
+        counts[root]++;
+    }
+
+    /*
+    * Exchanges the subtrees in two slots of the same count; the slots keep their parents.
+    * @param a The first slot.
+    * @param b The second slot.
+    */
+    void swapNodes(int a, int b){
+        swap(left[a], left[b]);
+        swap(right[a], right[b]);
+        for (int node: {a, b}){
+            if (left[node] < 0){
+                leafOf[right[node]] = node;
+            } else {
+                parent[left[node]] = parent[right[node]] = node;
+            }
+        }
+    }
+};
+
+/*
+* Compile-time facts about an alphabet of symbols, used by SymbolCoder to pick its tables.
+* Dense alphabets are small enough to index tables by symbol; sparse ones (32-bit token IDs) use hash maps.
+*/
+template <typename Symbol> struct AlphabetTraits;
+
+template <> struct AlphabetTraits<uint8_t>{
+    static constexpr bool dense = true;
+    static constexpr size_t size = 256;
+    using Counts = array<uint64_t, 256>;
+};
+
+template <> struct AlphabetTraits<uint16_t>{
+    static constexpr bool dense = true;
+    static constexpr size_t size = 65536;
+    using Counts = vector<uint64_t>;
+};
+
+template <> struct AlphabetTraits<uint32_t>{
+    static constexpr bool dense = false;
+    static constexpr size_t size = 0; // unbounded; only the symbols that occur are stored
+    using Counts = unordered_map<uint32_t, uint64_t>;
+};
+
+/*
+* A Huffman coder for buffers of 8-, 16- or 32-bit symbols, such as the token IDs of tokenized text.
+* The code lengths are built like HuffmanTree's (two queues over the sorted counts, limited with packageMerge())
+* and made canonical; decoding goes through a DecodeTable built over the codes in canonical order, or through a
+* DecodeTree when there are too many codes or they are too long for the table (see DecodeTree::prefer()).
+* Message format: [code count: 4 bytes][symbol: sizeof(Symbol) bytes][code length: 1 byte]... in canonical order,
+*   then [symbol count: 8 bytes][codes packed MSB-first into 64-bit big-endian words]. Integers are little-endian.
+*/
+template <typename Symbol>
+struct SymbolCoder{
+    using Traits = AlphabetTraits<Symbol>;
+    using CodeMap = conditional_t<Traits::dense, vector<HuffmanCode>, unordered_map<Symbol, HuffmanCode>>;
+
+    typename Traits::Counts counts{}; // frequency of each symbol
+    vector<Symbol> symbols; // the symbols with a code, in canonical order
+    vector<HuffmanCode> codes; // the code of each of symbols
+    CodeMap codeOf; // the code of each symbol, for encoding
+    DecodeTable decodeTable; // over codes, so lookups return an index into symbols
+    DecodeTree decodeTree; // used instead of decodeTable if treeDecoding
+    bool treeDecoding = false; // whether assignCodes() built decodeTree rather than decodeTable
+    int maxCodeLength = 32; // longest code build() may assign (at most 32); raised if too small for the number of symbols
+    Arena arena; // scratch for build() and assignCodes()
+
+    SymbolCoder(){
+        if constexpr (is_same<typename Traits::Counts, vector<uint64_t>>::value){
+            counts.assign(Traits::size, 0);
+        }
+    }
+
+    /*
+    * Adds the frequencies of the symbols in a buffer to counts.
+    * @param data The symbols to count.
+    * @param size The number of symbols in data.
+    */
+    void count(const Symbol* data, size_t size){
+        if constexpr (is_same<Symbol, uint8_t>::value){
+            countBytes(data, size, counts);
+        } else {
+            for (size_t i = 0; i < size; i++){
+                counts[data[i]]++;
+            }
+        }
+    }
+
+    /*
+    * Builds length-limited canonical codes for counts.
+    */
+    void build(){
+        Arena::Scope scope(arena);
+        size_t n = 0;
+        if constexpr (Traits::dense){
+            for (size_t symbol = 0; symbol < Traits::size; symbol++){
+                n += counts[symbol] != 0;
+            }
+        } else {
+            n = counts.size();
+        }
+        pair<uint64_t, Symbol>* used = arena.allocate<pair<uint64_t, Symbol>>(n); // (count, symbol), cheapest first
+        n = 0;
+        if constexpr (Traits::dense){
+            for (size_t symbol = 0; symbol < Traits::size; symbol++){
+                if (counts[symbol]) used[n++] = {counts[symbol], Symbol(symbol)};
+            }
+        } else {
+            for (const pair<const Symbol, uint64_t>& p: counts){
+                if (p.second) used[n++] = {p.second, p.first};
+            }
+        }
+        sort(used, used + n);
+        uint64_t* weights = arena.allocate<uint64_t>(n);
+        for (size_t i = 0; i < n; i++){
+            weights[i] = used[i].first;
+        }
+        unsigned char* lengths = arena.allocate<unsigned char>(n);
+        int longest = codeLengths(weights, n, lengths, arena);
+        int limit = min(max(maxCodeLength, 1), 32);
+        while ((uint64_t(1) << limit) < n) limit++;
+        if (longest > limit){
+            packageMerge(weights, lengths, n, limit, arena);
+        }
+
+        symbols.resize(n);
+        codes.resize(n);
+        for (size_t i = 0; i < n; i++){
+            symbols[i] = used[i].second;
+            codes[i].length = lengths[i];
+        }
+        assignCodes();
+    }
+
+    /*
+    * Computes Huffman code lengths for sorted weights with the two-queue method of FlatHuffmanTree.
+    * @param weights The counts of the symbols, in non-decreasing order.
+    * @param n The number of symbols.
+    * @param lengths Receives the code length of each symbol; lengths over 255 are stored as 255.
+    * @param scratch Holds the tree while it is built.
+    * @return The longest code length.
+    */
+    static int codeLengths(const uint64_t* weights, size_t n, unsigned char* lengths, Arena& scratch){
+        if (n <= 1){
+            if (n) lengths[0] = 1; // a lone symbol still needs one bit
+            return n;
+        }
+        Arena::Scope scope(scratch);
+        uint64_t* weight = scratch.allocate<uint64_t>(2 * n - 1);
+        copy(weights, weights + n, weight);
+        size_t* parent = scratch.allocate<size_t>(2 * n - 1);
+        size_t size = n;
+        size_t nextLeaf = 0;
+        size_t nextInternal = n;
+        // takes the cheapest node from the front of either queue
+        auto takeCheapest = [&](){
+            if (nextLeaf < n && (nextInternal >= size || weight[nextLeaf] <= weight[nextInternal]))
+                return nextLeaf++;
+            return nextInternal++;
+        };
+        while (size < 2 * n - 1){
+            size_t right = takeCheapest();
+            size_t left = takeCheapest();
+            weight[size] = weight[left] + weight[right];
+            parent[left] = parent[right] = size;
+            size++;
+        }
+        // parents come after their children, so depths are known from the root (the last node) down
+        int* depth = scratch.allocate<int>(2 * n - 1);
+        depth[2 * n - 2] = 0;
+        int longest = 0;
+        for (size_t i = 2 * n - 2; i-- > 0;){
+            depth[i] = depth[parent[i]] + 1;
+        }
+        for (size_t i = 0; i < n; i++){
+            lengths[i] = min(depth[i], 255);
+            longest = max(longest, depth[i]);
+        }
+        return longest;
+    }
+
+    /*
+    * Puts symbols in canonical order and assigns their canonical codes from the lengths in codes.
+    * @return Whether the lengths form a prefix code; they may not if they were read from corrupt data.
+    */
+    bool assignCodes(){
+        Arena::Scope scope(arena);
+        size_t n = symbols.size();
+        size_t* order = arena.allocate<size_t>(n);
+        for (size_t i = 0; i < n; i++){
+            order[i] = i;
+        }
+        sort(order, order + n, [&](size_t a, size_t b){
+            return codes[a].length < codes[b].length || (codes[a].length == codes[b].length && symbols[a] < symbols[b]);
+        });
+        Symbol* sortedSymbols = arena.allocate<Symbol>(n);
+        HuffmanCode* sortedCodes = arena.allocate<HuffmanCode>(n);
+        uint64_t code = 0;
+        int length = 0;
+        for (size_t i = 0; i < n; i++){
+            sortedSymbols[i] = symbols[order[i]];
+            sortedCodes[i].length = codes[order[i]].length;
+            if (sortedCodes[i].length < 1 || sortedCodes[i].length > 32) return false;
+            code = i ? (code + 1) << (sortedCodes[i].length - length) : 0;
+            length = sortedCodes[i].length;
+            if (code >> length) return false; // more codes than the lengths leave room for
+            sortedCodes[i].bits = code;
+        }
+        copy(sortedSymbols, sortedSymbols + n, symbols.begin());
+        copy(sortedCodes, sortedCodes + n, codes.begin());
+
+        if constexpr (Traits::dense){
+            codeOf.assign(Traits::size, HuffmanCode{0, 0});
+        } else {
+            codeOf.clear();
+            codeOf.reserve(symbols.size());
+        }
+        for (size_t i = 0; i < symbols.size(); i++){
+            codeOf[symbols[i]] = codes[i];
+        }
+        treeDecoding = DecodeTree::prefer(n, length);
+        if (treeDecoding) return decodeTree.build(codes.data(), codes.size());
+        decodeTable.build(codes.data(), codes.size());
+        return true;
+    }
+
+    /*
+    * Encodes a buffer of symbols with codes built for it, table first.
+    * @param data The symbols.
+    * @param size The number of symbols in data.
+    * @param output Receives the encoded message.
+    */
+    void encode(const Symbol* data, size_t size, vector<unsigned char>& output){
+        if constexpr (Traits::dense){
+            fill(counts.begin(), counts.end(), 0);
+        } else {
+            counts.clear();
+        }
+        count(data, size);
+        build();
+
+        output.clear();
+        writeInt(output, symbols.size(), 4);
+        for (size_t i = 0; i < symbols.size(); i++){
+            writeInt(output, symbols[i], sizeof(Symbol));
+            output.push_back(codes[i].length);
+        }
+        writeInt(output, size, 8);
+        size_t start = output.size();
+        int longest = codes.empty() ? 0 : codes.back().length;
+        output.resize(start + BitWriter::capacity(uint64_t(size) * longest));
+        BitWriter writer(output.data() + start);
+        for (size_t i = 0; i < size; i++){
+            const HuffmanCode& code = codeOf[data[i]];
+            writer.write(code.bits, code.length);
+        }
+        output.resize(start + writer.finish());
+    }
+
+    /*
+    * Decodes a message written by encode().
+    * @param data The encoded message.
+    * @param size The number of bytes in data.
+    * @param output Receives the symbols.
+    * @return Whether the message was well formed and held all the codes.
+    */
+    bool decode(const unsigned char* data, size_t size, vector<Symbol>& output){
+        output.clear();
+        if (size < 4) return false;
+        uint64_t count = readInt(data, 4);
+        size_t used = 4;
+        if (count > (size - used) / (sizeof(Symbol) + 1)) return false;
+        symbols.resize(count);
+        codes.resize(count);
+        for (size_t i = 0; i < count; i++, used += sizeof(Symbol) + 1){
+            symbols[i] = readInt(data + used, sizeof(Symbol));
+            codes[i].length = data[used + sizeof(Symbol)];
+        }
+        if (!assignCodes() || size < used + 8) return false;
+        uint64_t length = readInt(data + used, 8);
+        used += 8;
+        if (length > 8 * (size - used) || (length && symbols.empty())) return false; // every code has at least one bit
+        output.resize(length);
+
+        BitReader reader(data + used, size - used);
+        if (treeDecoding){
+            const uint32_t* nodes = decodeTree.nodes.data();
+            decodeSymbols(reader, output.data(), length, decodeTree.maxLength, [nodes](BitReader& stream){
+                return DecodeTree::lookupIndex(nodes, stream);
+            });
+        } else {
+            const uint32_t* entries = decodeTable.data();
+            int rootBits = decodeTable.rootBits;
+            decodeSymbols(reader, output.data(), length, decodeTable.maxLength, [entries, rootBits](BitReader& stream){
+                return DecodeTable::lookupIndex(entries, rootBits, stream);
+            });
+        }
+        return 8 * reader.position - reader.count <= 8 * (size - used); // the codes did not run past the message
+    }
+
+    /*
+    * Decodes a number of symbols, looking up as many codes per refill as the reservoir is guaranteed to hold.
+    * @param reader The bitstream positioned at the first code.
+    * @param output The destination, with room for count symbols.
+    * @param count The number of symbols to decode.
+    * @param maxLength The longest code.
+    * @param lookup Decodes one code from the reservoir and returns its index in symbols.
+    */
+    template <typename Lookup>
+    void decodeSymbols(BitReader& reader, Symbol* output, size_t count, int maxLength, Lookup lookup) const {
+        size_t steps = 56 / max(maxLength, 1); // a refill leaves at least 56 bits
+        size_t i = 0;
+        for (; i + steps <= count; i += steps){
+            reader.refill();
+            for (size_t step = 0; step < steps; step++){
+                output[i + step] = symbols[lookup(reader)];
+            }
+        }
+        for (; i < count; i++){
+            reader.refill();
+            output[i] = symbols[lookup(reader)];
+        }
+    }
+};
+
+/*
+* An order-1 Huffman coder: each byte is coded with a table chosen by the byte before it, which suits text, where
+* the next byte depends heavily on the last one. The 256 contexts are clustered into at most maxTables tables to
+* keep the header small; encode() tries 1, 2, 4, 8 and 16 tables and keeps the count that makes the smallest message.
+* Codes are limited to maxLength bits, so code lengths and table numbers pack two to a byte.
+* Message format: [table count: 1 byte][table of each context: 128 bytes, only with 2 or more tables]
+*   [code lengths of each table: 128 bytes][text length: 8 bytes][codes packed MSB-first into 64-bit big-endian words].
+*   Table numbers and lengths are 4 bits each, low nibble first; the context of the first byte is 0. Integers are little-endian.
+*/
+struct ContextCoder{
+    static constexpr int maxTables = 16;
+    static constexpr int maxLength = 15; // longest code; 3 codes fit in the 56 bits of a refill or flush
+
+    vector<array<uint64_t, 256>> counts = vector<array<uint64_t, 256>>(256); // counts[previous byte][byte]
+    int tableCount = 0;
+    array<unsigned char, 256> tableOf{}; // the table of each context
+    array<array<unsigned char, 256>, maxTables> lengths{}; // code length of each byte value, per table
+    array<array<HuffmanCode, 256>, maxTables> codes{}; // code of each byte value, per table
+    array<DecodeTable, maxTables> decodeTables;
+    uint64_t codedBits = 0; // bits of codes the chosen tables give the text
+    Arena arena; // scratch for packageMerge()
+
+    /*
+    * Encodes a buffer of text with tables built for it, tables first.
+    * @param data The text.
+    * @param size The number of bytes in data.
+    * @param output Receives the encoded message.
+    */
+    void encode(const unsigned char* data, size_t size, vector<unsigned char>& output){
+        for (array<uint64_t, 256>& context: counts){
+            context.fill(0);
+        }
+        unsigned char previous = 0;
+        for (size_t i = 0; i < size; i++){
+            counts[previous][data[i]]++;
+            previous = data[i];
+        }
+        chooseTables();
+
+        output.clear();
+        output.push_back(tableCount);
+        if (tableCount > 1) packNibbles(tableOf.data(), output);
+        for (int table = 0; table < tableCount; table++){
+            packNibbles(lengths[table].data(), output);
+            assignCodes(table);
+        }
+        writeInt(output, size, 8);
+
+        const HuffmanCode* codesOf[256]; // the codes to use after each byte value
+        for (int context = 0; context < 256; context++){
+            codesOf[context] = codes[tableOf[context]].data();
+        }
+        size_t start = output.size();
+        output.resize(start + BitWriter::capacity(codedBits));
+        BitWriter writer(output.data() + start);
+        constexpr size_t group = 56 / maxLength;
+        previous = 0;
+        size_t i = 0;
+        for (; i + group <= size; i += group){
+            for (size_t code = 0; code < group; code++){
+                const HuffmanCode& next = codesOf[previous][data[i + code]];
+                writer.add(next.bits, next.length);
+                previous = data[i + code];
+            }
+            writer.flush();
+        }
+        for (; i < size; i++){
+            const HuffmanCode& next = codesOf[previous][data[i]];
+            writer.write(next.bits, next.length);
+            previous = data[i];
+        }
+        output.resize(start + writer.finish());
+    }
+
+    /*
+    * Decodes a message written by encode().
+    * @param data The message.
+    * @param size The number of bytes in data.
+    * @param output Receives the text.
+    * @return Whether the message was well formed; if not, output is incomplete.
+    */
+    bool decode(const unsigned char* data, size_t size, vector<unsigned char>& output){
+        output.clear();
+        if (size < 1 || data[0] > maxTables) return false;
+        tableCount = data[0];
+        size_t used = 1;
+        tableOf.fill(0);
+        if (tableCount > 1){
+            if (size < used + 128) return false;
+            unpackNibbles(data + used, tableOf.data());
+            used += 128;
+            for (unsigned char table: tableOf){
+                if (table >= tableCount) return false;
+            }
+        }
+        if (size < used + 128 * tableCount + 8) return false;
+        for (int table = 0; table < tableCount; table++, used += 128){
+            unpackNibbles(data + used, lengths[table].data());
+            if (!assignCodes(table)) return false;
+            decodeTables[table].build(codes[table]);
+        }
+        uint64_t length = readInt(data + used, 8);
+        used += 8;
+        if (length > 8 * (size - used) || (length && tableCount == 0)) return false; // every code has at least one bit
+        output.resize(length);
+
+        const uint32_t* entriesOf[256]; // the table to use after each byte value
+        int rootBitsOf[256];
+        for (int context = 0; context < 256; context++){
+            entriesOf[context] = decodeTables[tableOf[context]].data();
+            rootBitsOf[context] = decodeTables[tableOf[context]].rootBits;
+        }
+        BitReader reader(data + used, size - used);
+        unsigned char* text = output.data();
+        constexpr size_t steps = 56 / maxLength; // a refill leaves at least 56 bits
+        unsigned char previous = 0;
+        size_t i = 0;
+        for (; i + steps <= length; i += steps){
+            reader.refill();
+            for (size_t step = 0; step < steps; step++){
+                previous = DecodeTable::lookup(entriesOf[previous], rootBitsOf[previous], reader);
+                text[i + step] = previous;
+            }
+        }
+        for (; i < length; i++){
+            reader.refill();
+            previous = DecodeTable::lookup(entriesOf[previous], rootBitsOf[previous], reader);
+            text[i] = previous;
+        }
+        return 8 * reader.position - reader.count <= 8 * (size - used); // the codes did not run past the message
+    }
+
+    /*
+    * Clusters the contexts in counts into tables, choosing the number of tables that makes the smallest message,
+    * and sets tableCount, tableOf, lengths and codedBits.
+    */
+    void chooseTables(){
+        vector<int> contexts; // contexts that occur, most frequent first
+        array<uint64_t, 256> totals{};
+        for (int context = 0; context < 256; context++){
+            for (uint64_t count: counts[context]){
+                totals[context] += count;
+            }
+            if (totals[context]) contexts.push_back(context);
+        }
+        stable_sort(contexts.begin(), contexts.end(), [&totals](int a, int b){
+            return totals[a] > totals[b];
+        });
+        tableCount = 0;
+        tableOf.fill(0);
+        codedBits = 0;
+
+        uint64_t best = UINT64_MAX;
+        array<unsigned char, 256> assignment;
+        array<array<unsigned char, 256>, maxTables> candidate;
+        for (size_t target = 1; target <= maxTables && target <= contexts.size(); target *= 2){
+            if (8 * (1 + (target > 1 ? 128 : 0) + 128 * target) >= best) break; // the tables alone cost more
+            int made = clusterContexts(contexts, target, assignment);
+            uint64_t bits = 0;
+            for (int table = 0; table < made; table++){
+                array<uint64_t, 256> sum{};
+                for (int context: contexts){
+                    if (assignment[context] != table) continue;
+                    for (int byte = 0; byte < 256; byte++){
+                        sum[byte] += counts[context][byte];
+                    }
+                }
+                packageMerge(sum, candidate[table], maxLength, arena);
+                for (int byte = 0; byte < 256; byte++){
+                    bits += sum[byte] * candidate[table][byte];
+                }
+            }
+            uint64_t header = 8 * (1 + (made > 1 ? 128 : 0) + 128 * made);
+            if (bits + header < best){
+                best = bits + header;
+                tableCount = made;
+                tableOf = assignment;
+                copy(candidate.begin(), candidate.begin() + made, lengths.begin());
+                codedBits = bits;
+            } else {
+                break; // more tables rarely pay off once they stop helping
+            }
+        }
+    }
+
+    /*
+    * Groups contexts with similar distributions by k-means: each context joins the table that would code its
+    * bytes in the fewest bits, estimated from the table's frequencies with half a count added to every byte
+    * value, and the tables are then recounted from their contexts, until no context moves.
+    * @param contexts The contexts that occur, most frequent first; the first target of them seed the tables.
+    * @param target The number of tables to make.
+    * @param assignment Receives the table of each context; contexts that do not occur get table 0.
+    * @return The number of tables made, at most target; tables left without contexts are dropped.
+    */
+    int clusterContexts(const vector<int>& contexts, size_t target, array<unsigned char, 256>& assignment){
+        vector<array<uint64_t, 256>> sums(target);
+        for (size_t table = 0; table < target; table++){
+            sums[table] = counts[contexts[table]];
+        }
+        assignment.fill(0);
+        vector<array<double, 256>> cost(target); // estimated bits of each byte value under each table
+        for (int iteration = 0; iteration < 16; iteration++){
+            for (size_t table = 0; table < target; table++){
+                uint64_t total = 0;
+                for (uint64_t count: sums[table]){
+                    total += count;
+                }
+                double scale = log2(total + 128.0);
+                for (int byte = 0; byte < 256; byte++){
+                    cost[table][byte] = scale - log2(sums[table][byte] + 0.5);
+                }
+            }
+            bool moved = false;
+            for (int context: contexts){
+                size_t nearest = 0;
+                double nearestBits = numeric_limits<double>::max();
+                for (size_t table = 0; table < target; table++){
+                    double bits = 0;
+                    for (int byte = 0; byte < 256; byte++){
+                        bits += counts[context][byte] * cost[table][byte];
+                    }
+                    if (bits < nearestBits){
+                        nearestBits = bits;
+                        nearest = table;
+                    }
+                }
+                moved |= iteration == 0 || assignment[context] != nearest;
+                assignment[context] = nearest;
+            }
+            if (!moved) break;
+            for (array<uint64_t, 256>& sum: sums){
+                sum.fill(0);
+            }
+            for (int context: contexts){
+                for (int byte = 0; byte < 256; byte++){
+                    sums[assignment[context]][byte] += counts[context][byte];
+                }
+            }
+        }
+
+        // number the tables that kept contexts consecutively
+        array<int, maxTables> renumbered;
+        renumbered.fill(-1);
+        int made = 0;
+        for (int context: contexts){
+            if (renumbered[assignment[context]] < 0) renumbered[assignment[context]] = made++;
+        }
+        for (int context: contexts){
+            assignment[context] = renumbered[assignment[context]];
+        }
+        return made;
+    }
+
+    /*
+    * Assigns canonical codes to one table from its code lengths.
+    * @param table The table.
+    * @return Whether the lengths form a prefix code with at least one code; they may not if they were read from corrupt data.
+    */
+    bool assignCodes(int table){
+        array<int, maxLength + 1> lengthCounts{};
+        for (unsigned char length: lengths[table]){
+            lengthCounts[length]++;
+        }
+        lengthCounts[0] = 0;
+        uint32_t kraft = 0; // sum of 2^(maxLength - length) over the codes
+        array<uint32_t, maxLength + 1> nextCode{};
+        uint32_t code = 0;
+        for (int length = 1; length <= maxLength; length++){
+            kraft += uint32_t(lengthCounts[length]) << (maxLength - length);
+            code = (code + lengthCounts[length - 1]) << 1;
+            nextCode[length] = code;
+        }
+        if (kraft == 0 || kraft > (uint32_t(1) << maxLength)) return false;
+        for (int byte = 0; byte < 256; byte++){
+            int length = lengths[table][byte];
+            codes[table][byte] = HuffmanCode{length ? nextCode[length]++ : 0, (unsigned char)length};
+        }
+        return true;
+    }
+
+    /*
+    * Appends 256 values below 16 to a buffer, two to a byte, low nibble first.
+    * @param values The values.
+    * @param output The buffer to append to.
+    */
+    static void packNibbles(const unsigned char* values, vector<unsigned char>& output){
+        for (int i = 0; i < 256; i += 2){
+            output.push_back(values[i] | (values[i + 1] << 4));
+        }
+    }
+
+    /*
+    * Reads 256 values written by packNibbles().
+    * @param data The 128 packed bytes.
+    * @param values Receives the values.
+    */
+    static void unpackNibbles(const unsigned char* data, unsigned char* values){
+        for (int i = 0; i < 128; i++){
+            values[2 * i] = data[i] & 0xF;
+            values[2 * i + 1] = data[i] >> 4;
+        }
+    }
+};
+
+/*
+* A reversible stage applied to each block of text before it is coded, such as a Burrows-Wheeler transform.
+* Stages are chained through HuffmanTree::transforms; their IDs are stored in the header of the encoded file,
+* and decoding looks them up with find() to run their inverses in reverse order. New stages are added by
+* subclassing and calling add() with an unused ID before encoding or decoding.
+*/
+struct Transform{
+    enum { runLength = 1, moveToFront = 2, burrowsWheeler = 3 }; // IDs of the built-in stages
+
+    virtual ~Transform(){}
+
+    /*
+    * @return The ID stored in encoded files.
+    */
+    virtual int id() const = 0;
+
+    /*
+    * Transforms a block of text.
+    * @param data The input.
+    * @param size The number of bytes in data.
+    * @param output Receives the transformed bytes.
+    * @param scratch Memory for the stage's working arrays; it is rewound once the call returns.
+    */
+    virtual void forward(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena& scratch) const = 0;
+
+    /*
+    * Undoes forward().
+    * @param data The transformed bytes.
+    * @param size The number of bytes in data.
+    * @param output Receives the original bytes.
+    * @param scratch Memory for the stage's working arrays; it is rewound once the call returns.
+    * @return Whether data could have been written by forward().
+    */
+    virtual bool inverse(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena& scratch) const = 0;
+
+    /*
+    * @param size The size of an input.
+    * @return The largest output forward() can produce for it.
+    */
+    virtual size_t maxOutput(size_t size) const = 0;
+
+    /*
+    * Registers a stage so that files using it can be decoded.
+    * @param transform The stage; it replaces any stage with the same ID.
+    */
+    static void add(shared_ptr<const Transform> transform);
+
+    /*
+    * @param id The ID of a stage.
+    * @return The stage, or nullptr if no stage has that ID.
+    */
+    static shared_ptr<const Transform> find(int id);
+};
+
+/*
+* Run-length encoding as in bzip2: after 4 equal bytes, one byte counts how many more repeats follow (0-255).
+* Shorter runs are copied as they are, so the output is at most 5/4 of the input.
+*/
+struct RunLengthTransform: Transform{
+    int id() const override {
+        return runLength;
+    }
+
+    void forward(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena&) const override {
+        output.clear();
+        for (size_t i = 0; i < size;){
+            size_t run = 1;
+            while (i + run < size && data[i + run] == data[i] && run < 4 + 255) run++;
+            output.insert(output.end(), min<size_t>(run, 4), data[i]);
+            if (run >= 4) output.push_back(run - 4);
+            i += run;
+        }
+    }
+
+    bool inverse(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena&) const override {
+        output.clear();
+        int repeats = 0; // equal bytes copied in a row
+        for (size_t i = 0; i < size; i++){
+            if (repeats == 4){
+                output.insert(output.end(), data[i], output.back());
+                repeats = 0;
+                continue;
+            }
+            repeats = !output.empty() && output.back() == data[i] ? repeats + 1 : 1;
+            output.push_back(data[i]);
+        }
+        return repeats < 4; // a run of 4 is always followed by its count
+    }
+
+    size_t maxOutput(size_t size) const override {
+        return size + size / 4;
+    }
+};
+
+/*
+* Move-to-front coding: every byte is replaced by its position in a list of all byte values, then moved to the
+* front of the list. Recently seen bytes get small values, which turns the local clustering left by a
+* Burrows-Wheeler transform into a skewed histogram.
+*/
+struct MoveToFrontTransform: Transform{
+    int id() const override {
+        return moveToFront;
+    }
+
+    void forward(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena&) const override {
+        array<unsigned char, 256> order;
+        for (int i = 0; i < 256; i++){
+            order[i] = i;
+        }
+        output.resize(size);
+        for (size_t i = 0; i < size; i++){
+            int position = 0;
+            while (order[position] != data[i]) position++;
+            output[i] = position;
+            memmove(order.data() + 1, order.data(), position);
+            order[0] = data[i];
+        }
+    }
+
+    bool inverse(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena&) const override {
+        array<unsigned char, 256> order;
+        for (int i = 0; i < 256; i++){
+            order[i] = i;
+        }
+        output.resize(size);
+        for (size_t i = 0; i < size; i++){
+            unsigned char byte = order[data[i]];
+            output[i] = byte;
+            memmove(order.data() + 1, order.data(), data[i]);
+            order[0] = byte;
+        }
+        return true;
+    }
+
+    size_t maxOutput(size_t size) const override {
+        return size;
+    }
+};
+
+/*
+* The Burrows-Wheeler transform: the last column of the sorted rotations of the block, which groups bytes that
+* precede similar contexts. Output: [row of the original block: 4 bytes][last column].
+* The rotations are sorted by prefix doubling: each round sorts them by their first 2k bytes from the ranks of
+* their first k bytes with two stable counting sorts, stopping once all ranks differ; at most log2(n) rounds.
+*/
+struct BurrowsWheelerTransform: Transform{
+    int id() const override {
+        return burrowsWheeler;
+    }
+
+    void forward(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena& scratch) const override {
+        output.assign(4 + size, 0);
+        if (size == 0) return;
+        Arena::Scope scope(scratch);
+        uint32_t n = size;
+        uint32_t* rotations = scratch.allocate<uint32_t>(n); // start of each rotation, in sorted order
+        uint32_t* rank = scratch.allocate<uint32_t>(n); // rank of each rotation by the bytes sorted on so far
+        uint32_t* byKey = scratch.allocate<uint32_t>(n);
+        uint32_t* buckets = scratch.allocate<uint32_t>(max<uint32_t>(n, 256) + 1);
+        fill(buckets, buckets + 257, 0);
+
+        // sort by the first byte
+        for (uint32_t i = 0; i < n; i++){
+            buckets[data[i] + 1]++;
+        }
+        for (int i = 0; i < 256; i++){
+            buckets[i + 1] += buckets[i];
+        }
+        for (uint32_t i = 0; i < n; i++){
+            rotations[buckets[data[i]]++] = i;
+            rank[i] = data[i];
+        }
+        uint32_t classes = 256;
+
+        for (uint32_t k = 1; k < n; k <<= 1){
+            // rotation i - k in order of rotations is sorted by its second key, the rank of rotation i
+            for (uint32_t j = 0; j < n; j++){
+                byKey[j] = rotations[j] >= k ? rotations[j] - k : rotations[j] + n - k;
+            }
+            // stable counting sort by the first key
+            fill(buckets, buckets + classes + 1, 0);
+            for (uint32_t i = 0; i < n; i++){
+                buckets[rank[i] + 1]++;
+            }
+            for (uint32_t i = 0; i < classes; i++){
+                buckets[i + 1] += buckets[i];
+            }
+            for (uint32_t j = 0; j < n; j++){
+                rotations[buckets[rank[byKey[j]]]++] = byKey[j];
+            }
+            // new ranks, reusing byKey
+            uint32_t* newRank = byKey;
+            newRank[rotations[0]] = 0;
+            for (uint32_t j = 1; j < n; j++){
+                uint32_t current = rotations[j];
+                uint32_t previous = rotations[j - 1];
+                uint32_t currentNext = current + k < n ? current + k : current + k - n;
+                uint32_t previousNext = previous + k < n ? previous + k : previous + k - n;
+                newRank[current] = newRank[previous] + (rank[current] != rank[previous] || rank[currentNext] != rank[previousNext]);
+            }
+            swap(rank, byKey);
+            classes = rank[rotations[n - 1]] + 1;
+            if (classes == n) break;
+        }
+
+        for (uint32_t j = 0; j < n; j++){
+            if (rotations[j] == 0){
+                for (int i = 0; i < 4; i++){
+                    output[i] = (j >> (8 * i)) & 0xFF;
+                }
+            }
+            output[4 + j] = data[rotations[j] ? rotations[j] - 1 : n - 1];
+        }
+    }
+
+    bool inverse(const unsigned char* data, size_t size, vector<unsigned char>& output, Arena& scratch) const override {
+        output.clear();
+        if (size < 4) return false;
+        uint64_t primary = readInt(data, 4);
+        const unsigned char* last = data + 4;
+        uint32_t n = size - 4;
+        if (n == 0) return primary == 0;
+        if (primary >= n) return false;
+
+        // the row of the rotation starting one byte earlier, from the counts of the last column
+        array<uint32_t, 257> starts{};
+        for (uint32_t i = 0; i < n; i++){
+            starts[last[i] + 1]++;
+        }
+        for (int i = 0; i < 256; i++){
+            starts[i + 1] += starts[i];
+        }
+        Arena::Scope scope(scratch);
+        uint32_t* previousRow = scratch.allocate<uint32_t>(n);
+        for (uint32_t i = 0; i < n; i++){
+            previousRow[i] = starts[last[i]]++;
+        }
+        output.resize(n);
+        uint32_t row = primary;
+        for (uint32_t i = n; i-- > 0;){
+            output[i] = last[row];
+            row = previousRow[row];
+        }
+        return true;
+    }
+
+    size_t maxOutput(size_t size) const override {
+        return size + 4;
+    }
+};
+
+/*
+* @return The registered stages by ID, starting with the built-in ones.
+*/
+unordered_map<int, shared_ptr<const Transform>>& transformRegistry(){
+    static unordered_map<int, shared_ptr<const Transform>> registry = {
+        {Transform::runLength, make_shared<RunLengthTransform>()},
+        {Transform::moveToFront, make_shared<MoveToFrontTransform>()},
+        {Transform::burrowsWheeler, make_shared<BurrowsWheelerTransform>()},
+    };
+    return registry;
+}
+
+void Transform::add(shared_ptr<const Transform> transform){
+    transformRegistry()[transform->id()] = transform;
+}
+
+shared_ptr<const Transform> Transform::find(int id){
+    unordered_map<int, shared_ptr<const Transform>>& registry = transformRegistry();
+    auto stage = registry.find(id);
+    return stage == registry.end() ? nullptr : stage->second;
+}
+
+/*
+* Where each block of an encoded file starts and ends, read from the header and footer written by HuffmanTree::encode().
+*/
+struct BlockIndex{
+    uint64_t length = 0; // bytes of text in the whole file
+    uint64_t blockSize = 0; // bytes of text per block
+    bool shared = false; // whether the blocks use the table in the header
+    uint64_t blocksStart = 0; // file offset of the first block
+    vector<uint64_t> ends; // file offset just past each block
+    vector<shared_ptr<const Transform>> transforms; // applied to every block before coding, in order
+    bool intact = false; // whether the header was valid and the index covers exactly the bytes between it and the footer
+
+    size_t blockCount() const {
+        return ends.size();
+    }
+    uint64_t blockStart(size_t block) const {
+        return block ? ends[block - 1] : blocksStart;
+    }
+    size_t blockLength(size_t block) const {
+        return min<uint64_t>(blockSize, length - block * blockSize);
+    }
+
+    /*
+    * Reads the block index from the footer.
+    * Offsets are clamped so that a corrupt index can never point outside the blocks; intact tells whether any were,
+    * and whether the footer is whole.
+    * @param data The whole footer, from the end of the blocks to the footer checksum.
+    * @param blockCount The number of index entries.
+    * @param indexStart The file offset of the footer, where the last block must end.
+    */
+    void readFooter(const unsigned char* data, size_t blockCount, uint64_t indexStart){
+        intact = blockSize != 0 && readInt(data, 4) == 0 && crc32c(data + 4, 8 * blockCount + 12) == readInt(data + 8 * blockCount + 16, 4);
+        data += 4;
+        length = readInt(data + 8 * blockCount, 8);
+        ends.resize(blockCount);
+        for (size_t i = 0; i < blockCount; i++){
+            uint64_t end = blocksStart + readInt(data + 8 * i, 8);
+            ends[i] = min(max(end, blockStart(i)), indexStart);
+            intact = intact && ends[i] == end;
+        }
+        intact = intact && blockStart(blockCount) == indexStart;
+        if (blockSize == 0 || blockCount != (length + blockSize - 1) / blockSize){
+            length = 0; // the index does not describe this text
+            ends.clear();
+            intact = false;
+        }
+    }
+};
+
+// per-phase timers and counters in Stats: -DHUFFMAN_STATS=0 compiles them out entirely, 1 (the default) keeps counters
+// and wall times, and 2 adds CPU times, which cost a system call per reading and so slow down very small files
+#ifndef HUFFMAN_STATS
+#define HUFFMAN_STATS 1
+#endif
+#if HUFFMAN_STATS
+#define STATS(statement) statement
+#else
+#define STATS(statement)
+#endif
+
+/*
+* Counters and per-phase times of a HuffmanTree. Times are summed over every thread that worked on a phase, so with
+* several threads a phase can take longer than the call that ran it; "total" is the wall time of the calls themselves.
+* Workers' stats are merged into the tree that called encode() or decode() when the call returns, and accumulate
+* across calls until reset with stats = Stats().
+*/
+struct Stats{
+    enum Phase { total, io, count, build, header, transform, encodeBits, decodeBits, table, phases };
+    array<uint64_t, phases> wallNanos{}; // wall time per phase
+    array<uint64_t, phases> cpuNanos{}; // CPU time per phase, with HUFFMAN_STATS 2: of the threads, or of the process for total
+    uint64_t bytesIn = 0; // bytes read by encode() and decode()
+    uint64_t bytesOut = 0; // bytes they produced
+    uint64_t symbols = 0; // symbols coded or decoded
+    uint64_t blocks = 0; // blocks coded or decoded
+    uint64_t codeBuilds = 0; // codes built from counts by buildTree()
+    uint64_t tableBuilds = 0; // decode tables built from code lengths
+    uint64_t tablesReused = 0; // blocks coded with an earlier block's table
+
+    /*
+    * Adds the counters and times of other stats to these.
+    * @param other The stats to add; their total time is not added, since it overlaps these calls.
+    */
+    void add(const Stats& other){
+        for (int phase = total + 1; phase < phases; phase++){
+            wallNanos[phase] += other.wallNanos[phase];
+            cpuNanos[phase] += other.cpuNanos[phase];
+        }
+        bytesIn += other.bytesIn;
+        bytesOut += other.bytesOut;
+        symbols += other.symbols;
+        blocks += other.blocks;
+        codeBuilds += other.codeBuilds;
+        tableBuilds += other.tableBuilds;
+        tablesReused += other.tablesReused;
+    }
+
+    /*
+    * Prints the stats as a table of phases followed by the counters.
+    * @param output The stream to print to.
+    */
+    void print(ostream& output) const {
+        static const char* names[phases] = {"total", "io", "count", "build", "header", "transform", "encode bits", "decode bits", "table"};
+        bool cpu = HUFFMAN_STATS >= 2;
+        output << fixed << setfill(' ') << setprecision(3) << left << setw(14) << "phase" << right << setw(12) << "wall ms";
+        output << (cpu ? "      cpu ms" : "") << endl;
+        for (int phase = 0; phase < phases; phase++){
+            output << left << setw(14) << names[phase] << right << setw(12) << wallNanos[phase] / 1e6;
+            if (cpu) output << setw(12) << cpuNanos[phase] / 1e6;
+            output << endl;
+        }
+        double codingSeconds = (wallNanos[encodeBits] + wallNanos[decodeBits]) / 1e9;
+        output << "bytes in " << bytesIn << ", bytes out " << bytesOut << ", blocks " << blocks << endl
+            << "symbols " << symbols << " (" << setprecision(1) << (codingSeconds > 0 ? symbols / codingSeconds / 1e6 : 0) << " M/s while coding)" << endl
+            << "codes built " << codeBuilds << ", decode tables built " << tableBuilds << ", tables reused " << tablesReused << endl;
+    }
+};
+
+/*
+* Adds the wall and CPU time of its own lifetime to one phase of a Stats; used through STATS() so it can be compiled out.
+*/
+struct PhaseTimer{
+    Stats& stats;
+    Stats::Phase phase;
+    uint64_t wallStart;
+    uint64_t cpuStart = 0;
+
+    /*
+    * @param owner The stats to add the time to.
+    * @param timed The phase to add it to; total measures the CPU time of the whole process.
+    */
+    PhaseTimer(Stats& owner, Stats::Phase timed): stats(owner), phase(timed){
+        wallStart = clockNanos(CLOCK_MONOTONIC);
+#if HUFFMAN_STATS >= 2
+        cpuStart = clockNanos(phase == Stats::total ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID);
+#endif
+    }
+    ~PhaseTimer(){
+#if HUFFMAN_STATS >= 2
+        stats.cpuNanos[phase] += clockNanos(phase == Stats::total ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+#endif
+        stats.wallNanos[phase] += clockNanos(CLOCK_MONOTONIC) - wallStart;
+    }
+
+    static uint64_t clockNanos(clockid_t clock){
+        timespec time;
+        clock_gettime(clock, &time);
+        return uint64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+    }
+};
+
+struct HuffmanTree{
+    static constexpr unsigned char magic[4] = {'H', 'U', 'F', 'F'}; // the first bytes of every encoded file
+    static constexpr int formatVersion = 1; // of the layout written by encode(); other versions are rejected
+    array<HuffmanCode, 256> codes; // canonical code per byte value
+    array<unsigned char, 256> codeLengths{}; // code length per byte value; 0 if the byte is absent
+    array<uint64_t, 256> charCounts{}; // frequency per byte value from countCharFrequencies()
+    uint64_t maxBufferSize = uint64_t(1) << 30; // larger inputs are encoded in streaming mode
+    size_t streamBlockSize = 1 << 20; // bytes read, encoded or decoded at a time
+    bool useMemoryMap = false; // map input files and decode()'s output with mmap instead of using streams; encode() writes a stream
+    bool pipelined = true; // read the next batch of blocks and write the last one on I/O threads while coding this one
+    size_t blockSize = 1 << 20; // bytes of text per block of the encoded file; clamped to 1-UINT32_MAX, the range of the header field
+    bool sharedTable = false; // encode every block with one table for the whole file instead of one table per block
+    int threads = 0; // threads used to encode blocks; 0 uses one per hardware thread
+    int streams = 1; // interleaved bitstreams per block (1-8); more streams let one core decode several codes at once
+    bool reuseTables = true; // let a block reuse an earlier block's table when a fresh one would not pay for itself
+    DecodeTable decodeTable; // lookup table for the current codes, reused between blocks
+    int maxCodeLength = 32; // longest code buildTree() may assign (at most 32); raised if too small for the number of symbols
+    uint64_t lengthLimitCost = 0; // extra encoded bits caused by maxCodeLength in the last buildTree() or encode()
+    uint64_t encodedLength = 0; // bytes written by the last encode()
+    string outputName; // file written by the last encode() or decode()
+    bool writeFailed = false; // whether the last encode() or decode() could not create or write outputName
+    uint64_t loadedTableBlock = UINT64_MAX; // the block whose stored table decodeTable holds, for blocks that reuse it
+    bool verifyChecksums = true; // check each block's checksum before decoding it; a block that fails decodes to zeros
+    uint64_t corruptBlocks = 0; // blocks found corrupt by the last decode(), decodeRange() or verify()
+    vector<shared_ptr<const Transform>> transforms; // stages applied to every block before coding, in order; see Transform
+    vector<unsigned char> transformed; // a block after the transforms, or after their inverses in untransformBlock()
+    vector<unsigned char> transformStage; // scratch for the stage between two transforms
+    vector<HuffmanTree> workerTrees; // per-thread state of encode() and decode(), kept between files
+    vector<unsigned char> inputBuffer; // the file read by encode() or decode(), kept between files
+    vector<unsigned char> outputBuffer; // decoded text of decode(), kept between files
+    vector<vector<unsigned char>> blockBuffers; // encoded blocks of two batches in encode(), kept between files
+    Arena arena; // scratch for buildTree(), the transforms and encode()'s bookkeeping, kept between files
+    Stats stats; // counters and phase times of this tree and its workers; see HUFFMAN_STATS
+
+    /*
+    * Counts the frequencies of each character in a file. The counts are stored in charCounts.
+    * @param fileName The name of the file from which text is read.
+    */ 
+    void countCharFrequencies(string fileName){
+        ifstream input(fileName, ios::binary);
+        charCounts.fill(0);
+        countCharFrequencies(input);
+        input.close();
+    }
+
+    /*
+    * Adds the frequencies of each character in the rest of a stream to charCounts, one block at a time.
+    * @param input The stream from which text is read.
+    */
+    void countCharFrequencies(istream& input){
+        vector<unsigned char> block(streamBlockSize);
+        while (input.read((char*)block.data(), block.size()) || input.gcount() > 0){
+            addCharFrequencies(block.data(), input.gcount());
+        }
+    }
+
+    /*
+    * Adds the frequencies of each character in a buffer to charCounts.
+    * @param data The text to count.
+    * @param size The number of bytes in data.
+    */
+    void addCharFrequencies(const unsigned char* data, size_t size){
+        STATS(PhaseTimer timer(stats, Stats::count));
+        countBytes(data, size, charCounts);
+    }
+
+    /*
+    * Builds a huffman coding tree from charCounts and assigns the codes. The tree only lives on the stack while the
+    * code lengths are read from it, so decoders do not carry it.
+    * If the tree is deeper than maxCodeLength, the code lengths are recomputed with packageMerge() and
+    * lengthLimitCost records the extra bits.
+    * Precondition: countCharFrequencies() has been called.
+    */
+    void buildTree(){
+        STATS(PhaseTimer timer(stats, Stats::build));
+        STATS(stats.codeBuilds++);
+        FlatHuffmanTree flatTree;
+        flatTree.build(charCounts);
+        if (flatTree.leaves == 0){
+            codeLengths.fill(0);
+            assignCanonicalCodes();
+            return;
+        }
+        int longest = flatTree.codeLengths(codeLengths);
+        int symbols = flatTree.leaves;
+
+        // limit the code lengths, but never below what the number of symbols needs
+        int limit = min(max(maxCodeLength, 1), 32);
+        while ((1 << min(limit, 30)) < symbols) limit++;
+        lengthLimitCost = 0;
+        if (longest > limit){
+            uint64_t optimalBits = encodedBits();
+            packageMerge(charCounts, codeLengths, limit, arena);
+            lengthLimitCost = encodedBits() - optimalBits;
+        }
+        assignCanonicalCodes();
+    }
+
+    /*
+    * Computes the size of the encoded text for the current codeLengths.
+    * @return The total number of bits needed to encode charCounts.
+    */
+    uint64_t encodedBits(){
+        uint64_t bits = 0;
+        for (int i = 0; i < 256; i++){
+            bits += charCounts[i] * codeLengths[i];
+        }
+        return bits;
+    }
+
+    /*
+    * Replaces codes with the canonical Huffman codes for codeLengths.
+    * Symbols are ordered by code length, then by byte value; each code is the previous code plus one,
+    * shifted left whenever the length grows. Any decoder can rebuild the same codes from the lengths alone,
+    * and every leaf keeps its depth from buildTree(), so the code is still optimal.
+    * Precondition: no length in codeLengths exceeds 32.
+    */
+    void assignCanonicalCodes(){
+        array<int, 33> lengthCounts{};
+        for (unsigned char length: codeLengths){
+            lengthCounts[length]++;
+        }
+        // first code of each length
+        array<uint32_t, 33> nextCode{};
+        uint32_t code = 0;
+        lengthCounts[0] = 0;
+        for (int length = 1; length <= 32; length++){
+            code = (code + lengthCounts[length - 1]) << 1;
+            nextCode[length] = code;
+        }
+        for (int i = 0; i < 256; i++){
+            codes[i].length = codeLengths[i];
+            codes[i].bits = codeLengths[i] ? nextCode[codeLengths[i]]++ : 0;
+        }
+    }
+
+    /*
+    * Returns the current codes as strings of '0' and '1' characters, for callers that used the old map-based API.
+    * @return The map between a character and its binary (as a string).
+    */
+    unordered_map<char, string> getCodeMap() const {
+        unordered_map<char, string> codeMap;
+        for (int i = 0; i < 256; i++){
+            string bits;
+            for (int bit = codes[i].length - 1; bit >= 0; bit--){
+                bits += (codes[i].bits >> bit) & 1 ? '1' : '0';
+            }
+            if (codes[i].length) codeMap[char(i)] = bits;
+        }
+        return codeMap;
+    }
+
+    /*
+    * Writes codeLengths to a stream.
+    * Format: [symbol count: 2 bytes], then [byte][length] pairs when fewer than 128 symbols are used,
+    * otherwise one length byte for each of the 256 byte values.
+    * @param output The stream to write to.
+    */
+    void writeCodeLengths(ostream& output){
+        vector<unsigned char> bytes;
+        writeCodeLengths(bytes);
+        output.write((const char*)bytes.data(), bytes.size());
+    }
+
+    /*
+    * Appends codeLengths to a byte buffer in the format of writeCodeLengths(ostream&).
+    * @param output The buffer to append to.
+    */
+    void writeCodeLengths(vector<unsigned char>& output){
+        int symbols = 0;
+        for (unsigned char length: codeLengths){
+            symbols += length != 0;
+        }
+        writeInt(output, symbols, 2);
+        if (symbols < 128){
+            for (int i = 0; i < 256; i++){
+                if (!codeLengths[i]) continue;
+                output.push_back(i);
+                output.push_back(codeLengths[i]);
+            }
+        } else {
+            output.insert(output.end(), codeLengths.begin(), codeLengths.end());
+        }
+    }
+
+    /*
+    * Reads codeLengths from a stream in the format written by writeCodeLengths().
+    * @param input The stream to read from.
+    */
+    void readCodeLengths(istream& input){
+        unsigned char header[2 + 256];
+        input.read((char*)header, 2);
+        int symbols = header[0] | (header[1] << 8);
+        input.read((char*)header + 2, symbols < 128 ? 2 * symbols : 256);
+        readCodeLengths(header, 2 + input.gcount());
+    }
+
+    /*
+    * Measures code lengths in the format written by writeCodeLengths() without reading them.
+    * @param data The bytes starting at the symbol count.
+    * @param size The number of bytes available.
+    * @return The number of bytes the code lengths take, or 0 if size is too small to tell.
+    */
+    static size_t codeLengthsSize(const unsigned char* data, size_t size){
+        if (size < 2) return 0;
+        int symbols = data[0] | (data[1] << 8);
+        return 2 + (symbols < 128 ? 2 * symbols : 256);
+    }
+
+    /*
+    * Reads codeLengths from memory in the format written by writeCodeLengths().
+    * Lengths over 32 bits mean the data is corrupt; codeLengths is then left empty.
+    * @param data The bytes starting at the symbol count.
+    * @param size The number of bytes available.
+    * @return The number of bytes used by the code lengths.
+    */
+    size_t readCodeLengths(const unsigned char* data, size_t size){
+        codeLengths.fill(0);
+        if (size < 2) return size;
+        int symbols = data[0] | (data[1] << 8);
+        size_t used = 2;
+        if (symbols < 128){
+            for (; symbols > 0 && used + 2 <= size; symbols--, used += 2){
+                codeLengths[data[used]] = data[used + 1];
+            }
+        } else {
+            size_t available = min<size_t>(256, size - used);
+            memcpy(codeLengths.data(), data + used, available);
+            used += available;
+        }
+        for (unsigned char length: codeLengths){
+            if (length > 32){
+                codeLengths.fill(0); // corrupt; no code may be longer than 32 bits
+                break;
+            }
+        }
+        return used;
+    }
+
+    /*
+    * Export the Huffman coding trees and encoded text to a file.
+    * The text is split into blocks of blockSize bytes that are encoded independently by a thread pool and
+    * written in order. Exports in the binary format:
+    *   [magic: "HUFF"][format version: 1 byte][block size: 4 bytes][flags: 1 byte; 1 = shared table, 2 = transforms]
+    *   [transform count: 1 byte][transform ID: 1 byte each, in the order applied; if transforms]
+    *   [code lengths, see writeCodeLengths(), if shared]
+    *   [header checksum: CRC-32C of the header bytes before it, 4 bytes]
+    *   [block]... where each block is
+    *     [block length, after the transforms: 4 bytes][table distance: 4 bytes, unless shared][code lengths, unless shared or reused]
+    *     [stream count: 1 byte][jump table: byte size of every stream: 4 bytes each]
+    *     [stream]... each holding the codes of one consecutive segment of the block, packed into 64-bit big-endian words.
+    *     [checksum: CRC-32C of the block's bytes before it, 4 bytes]
+    *     The block is split into stream count segments of ceil(block length / stream count) bytes (the last may be
+    *     shorter); the padding in each stream's last word follows from that.
+    *     A block reuses the codes of the block table distance blocks back, or stores its own when the distance is 0.
+    *     With reuseTables, a block reuses the last stored table whenever a fresh one would not save its own size.
+    *   [end of blocks: 4 zero bytes]
+    *   [block index: end offset of each block, relative to the first block: 8 bytes each]
+    *   [original length: 8 bytes][block count: 4 bytes][footer checksum: CRC-32C of the index, length and count, 4 bytes]
+    * Integers outside the bitstreams are little-endian. The index sits at the end so blocks can be written as
+    * soon as they are encoded; a decoder finds it from the last 16 bytes. Every block also carries its own sizes,
+    * so a decoder that cannot seek (HuffmanDecoder) can read the blocks in order without the index.
+    * Each block of blockSize bytes of text is run through transforms on its own before it is coded, so blocks
+    * can still be decoded independently and in parallel.
+    * The file is read once into memory (or mapped, with useMemoryMap). Files larger than maxBufferSize are read
+    * one batch of blocks at a time unless they are mapped; a shared table then takes an extra counting pass.
+    * @param fileName The name of the file to be encoded.
+    * @return Whether the encoded file was written; if not, writeFailed is set.
+    */
+    virtual bool encode(string fileName){
+        STATS(PhaseTimer timer(stats, Stats::total));
+        int index = 0;
+        while (fileName.find('.', index+1) != -1){
+            index = fileName.find('.', index+1);
+        }
+        outputName = fileName.substr(0, index) + "_encoded.txt";
+        writeFailed = false;
+        blockSize = min<uint64_t>(max<size_t>(blockSize, 1), UINT32_MAX); // the header stores it in 4 bytes
+
+        // get the text as one span, unless it is too large to buffer
+        MappedFile mappedInput;
+        ifstream input;
+        vector<unsigned char>& text = inputBuffer;
+        const unsigned char* data = nullptr;
+        uint64_t length = 0;
+        bool streaming = false;
+        if (useMemoryMap && mappedInput.openRead(fileName)){
+            data = mappedInput.data;
+            length = mappedInput.size;
+        } else {
+            STATS(PhaseTimer timer(stats, Stats::io));
+            input.open(fileName, ios::binary | ios::ate);
+            length = input ? uint64_t(input.tellg()) : 0;
+            input.seekg(0);
+            if (length <= maxBufferSize){
+                text.resize(length);
+                input.read((char*)text.data(), text.size());
+                text.resize(input.gcount());
+                data = text.data();
+                length = text.size();
+            } else {
+                streaming = true;
+            }
+        }
+
+        ThreadPool pool(threads);
+        workerTrees.resize(pool.size());
+        vector<HuffmanTree>& workers = workerTrees;
+        for (HuffmanTree& worker: workers){
+            worker.maxCodeLength = maxCodeLength;
+            worker.transforms = transforms;
+            worker.charCounts.fill(0);
+        }
+
+        ofstream output(outputName, ios::binary);
+        if (!output){
+            writeFailed = true;
+            return false;
+        }
+        vector<unsigned char> header;
+        writeHeader(header, sharedTable);
+        lengthLimitCost = 0;
+        if (sharedTable){
+            charCounts.fill(0);
+            if (streaming && transforms.empty()){
+                countCharFrequencies(input);
+            } else if (streaming){
+                vector<unsigned char> block(blockSize);
+                while (input.read((char*)block.data(), block.size()) || input.gcount() > 0){
+                    size_t size = input.gcount();
+                    const unsigned char* text = transformBlock(block.data(), size, transformed);
+                    addCharFrequencies(text, size);
+                }
+            } else {
+                // per-thread histograms of one block each, merged afterwards
+                pool.run((length + blockSize - 1) / blockSize, [&](size_t i, int worker){
+                    HuffmanTree& tree = workers[worker];
+                    size_t size = min<uint64_t>(blockSize, length - i * blockSize);
+                    const unsigned char* text = tree.transformBlock(data + i * blockSize, size, tree.transformed);
+                    tree.addCharFrequencies(text, size);
+                });
+                for (HuffmanTree& worker: workers){
+                    for (int i = 0; i < 256; i++){
+                        charCounts[i] += worker.charCounts[i];
+                    }
+                }
+            }
+            buildTree();
+            writeCodeLengths(header);
+            if (streaming){
+                input.clear();
+                input.seekg(0);
+            }
+        }
+        writeInt(header, crc32c(header.data(), header.size()), 4);
+        output.write((const char*)header.data(), header.size());
+
+        // encode and export one batch of blocks at a time. With pipelined, batches alternate between two sets of
+        // buffers: the next batch is read into one input buffer and the last one written from one set of encoded
+        // blocks while this one is coded in the others
+        size_t batchBlocks = 2 * pool.size();
+        blockBuffers.resize(max(blockBuffers.size(), 2 * batchBlocks));
+        struct BlockPlan{
+            array<uint64_t, 256> counts;
+            array<unsigned char, 256> lengths; // the block's codes
+            uint64_t lengthLimitCost; // of its fresh table
+            uint64_t distance; // back to the block holding its table; 0 if it holds its own
+        };
+        Arena::Scope scope(arena);
+        BlockPlan* plans = arena.allocate<BlockPlan>(sharedTable ? 0 : batchBlocks);
+        const unsigned char** blockTexts = arena.allocate<const unsigned char*>(batchBlocks); // each block of the batch after the transforms
+        size_t* blockSizes = arena.allocate<size_t>(batchBlocks);
+        vector<vector<unsigned char>> transformedBlocks(batchBlocks);
+        array<unsigned char, 256> tableLengths; // the table later blocks may reuse
+        size_t tableBlock = SIZE_MAX; // the block holding it
+        vector<unsigned char> buffers[2];
+        size_t readSize = 0; // bytes the last read got
+        Stats readStats; // of the reads, merged when they are done; the reader and writer may run at once
+        Stats writeStats; // of the writes, likewise
+        BackgroundTask reader(pipelined);
+        BackgroundTask writer(pipelined);
+        auto readBatch = [&](int set){
+            STATS(PhaseTimer timer(readStats, Stats::io));
+            buffers[set].resize(batchBlocks * blockSize);
+            input.read((char*)buffers[set].data(), buffers[set].size());
+            readSize = input.gcount();
+        };
+        if (streaming) reader.run([&](){ readBatch(0); });
+        vector<uint64_t> blockEnds;
+        uint64_t position = 0;
+        uint64_t written = 0;
+        for (int set = 0; position < length; set ^= 1){
+            const unsigned char* batch = data + position;
+            size_t batchSize = min<uint64_t>(batchBlocks * blockSize, length - position);
+            if (streaming){
+                reader.wait();
+                batchSize = readSize;
+                if (batchSize == 0) break;
+                batch = buffers[set].data();
+                reader.run([&readBatch, set](){ readBatch(set ^ 1); });
+            }
+            vector<unsigned char>* encoded = blockBuffers.data() + set * batchBlocks; // written two batches ago at the latest
+            size_t blocks = (batchSize + blockSize - 1) / blockSize;
+            pool.run(blocks, [&](size_t i, int worker){
+                size_t start = i * blockSize;
+                blockSizes[i] = min(blockSize, batchSize - start);
+                blockTexts[i] = workers[worker].transformBlock(batch + start, blockSizes[i], transformedBlocks[i]);
+            });
+            if (sharedTable){
+                pool.run(blocks, [&](size_t i, int worker){
+                    workers[worker].encodeBlock(blockTexts[i], blockSizes[i], encoded[i], this);
+                });
+            } else {
+                // count and build a fresh table for every block concurrently
+                pool.run(blocks, [&](size_t i, int worker){
+                    HuffmanTree& tree = workers[worker];
+                    tree.charCounts.fill(0);
+                    tree.addCharFrequencies(blockTexts[i], blockSizes[i]);
+                    tree.buildTree();
+                    plans[i].counts = tree.charCounts;
+                    plans[i].lengths = tree.codeLengths;
+                    plans[i].lengthLimitCost = tree.lengthLimitCost;
+                });
+                // in order, keep each fresh table only if it pays for itself
+                for (size_t i = 0; i < blocks; i++){
+                    size_t block = blockEnds.size() + i;
+                    if (reuseTables && tableBlock < block && reuseTable(plans[i].counts, plans[i].lengths, tableLengths)){
+                        plans[i].distance = block - tableBlock;
+                        plans[i].lengths = tableLengths;
+                    } else {
+                        plans[i].distance = 0;
+                        tableLengths = plans[i].lengths;
+                        tableBlock = block;
+                        lengthLimitCost += plans[i].lengthLimitCost;
+                    }
+                }
+                pool.run(blocks, [&](size_t i, int worker){
+                    HuffmanTree& tree = workers[worker];
+                    tree.charCounts = plans[i].counts;
+                    tree.codeLengths = plans[i].lengths;
+                    tree.assignCanonicalCodes();
+                    tree.writeBlock(blockTexts[i], blockSizes[i], encoded[i], nullptr, plans[i].distance);
+                });
+            }
+            for (size_t i = 0; i < blocks; i++){
+                written += encoded[i].size();
+                blockEnds.push_back(written);
+            }
+            writer.run([&output, &writeStats, encoded, blocks](){
+                STATS(PhaseTimer timer(writeStats, Stats::io));
+                for (size_t i = 0; i < blocks; i++){
+                    output.write((const char*)encoded[i].data(), encoded[i].size());
+                }
+            });
+            position += batchSize;
+        }
+        reader.wait();
+        writer.wait();
+        STATS(stats.add(readStats));
+        STATS(stats.add(writeStats));
+
+        // export the block index
+        vector<unsigned char> footer;
+        writeFooter(footer, blockEnds, position);
+        output.write((const char*)footer.data(), footer.size());
+        encodedLength = header.size() + written + footer.size();
+        STATS(stats.bytesIn += position);
+        STATS(stats.bytesOut += encodedLength);
+        collectWorkerStats();
+
+        input.close();
+        writeFailed = !output;
+        output.close();
+        writeFailed |= !output;
+        return !writeFailed;
+    }
+
+    /*
+    * Adds the stats of the worker trees of encode() and decode() to stats and clears theirs.
+    */
+    void collectWorkerStats(){
+        for (HuffmanTree& worker: workerTrees){
+            stats.add(worker.stats);
+            worker.stats = Stats();
+        }
+    }
+
+    /*
+    * Trains a static table on a sample corpus and saves it to a file; see StaticTable.
+    * @param sampleFiles The files whose combined byte frequencies the table is built for.
+    * @param id The ID that messages encoded with the table will carry.
+    * @param tableName The name of the file to write the table to.
+    */
+    void trainStaticTable(const vector<string>& sampleFiles, uint32_t id, string tableName){
+        charCounts.fill(0);
+        for (const string& sampleFile: sampleFiles){
+            ifstream input(sampleFile, ios::binary);
+            countCharFrequencies(input);
+        }
+        vector<unsigned char> table;
+        writeStaticTable(id, table);
+        ofstream output(tableName, ios::binary);
+        output.write((const char*)table.data(), table.size());
+    }
+
+    /*
+    * Builds a static table from charCounts and appends it to a byte buffer.
+    * Every byte value is counted once more first, so bytes missing from the sample still get a code.
+    * Format, little-endian: [table ID: 4 bytes][root bits: 4][longest code: 4][decode entry count: 4]
+    *   [code of each byte value: bits: 4, length: 1, padding: 3][decode entries: 4 bytes each]
+    * The codes and entries are laid out like HuffmanCode and DecodeTable::entries, so a loaded table is used in place.
+    * @param id The ID that messages encoded with the table will carry.
+    * @param output The buffer to append to.
+    */
+    void writeStaticTable(uint32_t id, vector<unsigned char>& output){
+        for (uint64_t& count: charCounts){
+            count++;
+        }
+        buildTree();
+        decodeTable.build(codes);
+        writeInt(output, id, 4);
+        writeInt(output, decodeTable.rootBits, 4);
+        writeInt(output, decodeTable.maxLength, 4);
+        writeInt(output, decodeTable.entries.size(), 4);
+        for (const HuffmanCode& code: codes){
+            writeInt(output, code.bits, 4);
+            writeInt(output, code.length, 4);
+        }
+        for (uint32_t entry: decodeTable.entries){
+            writeInt(output, entry, 4);
+        }
+    }
+
+    /*
+    * Appends the magic, the version, the block size, the flags and the transform IDs of the header to a byte buffer;
+    * see encode(). The caller appends the shared table, if any, and then the checksum of the header.
+    * @param output The buffer to append to.
+    * @param shared Whether every block uses one table, which the caller appends next.
+    */
+    void writeHeader(vector<unsigned char>& output, bool shared){
+        output.insert(output.end(), magic, magic + 4);
+        writeInt(output, formatVersion, 1);
+        writeInt(output, blockSize, 4);
+        writeInt(output, shared | (transforms.empty() ? 0 : 2), 1);
+        if (!transforms.empty()){
+            writeInt(output, transforms.size(), 1);
+            for (const shared_ptr<const Transform>& transform: transforms){
+                writeInt(output, transform->id(), 1);
+            }
+        }
+    }
+
+    /*
+    * Runs one block of text through transforms.
+    * @param data The text of the block.
+    * @param size The number of bytes in data; receives the size of the result.
+    * @param output Receives the result, unless there are no transforms.
+    * @return The result: data itself if there are no transforms, otherwise the bytes of output.
+    */
+    const unsigned char* transformBlock(const unsigned char* data, size_t& size, vector<unsigned char>& output){
+        if (transforms.empty()) return data;
+        STATS(PhaseTimer timer(stats, Stats::transform));
+        for (const shared_ptr<const Transform>& transform: transforms){
+            transform->forward(data, size, transformStage, arena);
+            output.swap(transformStage);
+            data = output.data();
+            size = output.size();
+        }
+        return data;
+    }
+
+    /*
+    * @param transforms The stages applied to a block.
+    * @param size The size of the block.
+    * @return The largest size the block can have after them.
+    */
+    static uint64_t transformedSize(const vector<shared_ptr<const Transform>>& transforms, uint64_t size){
+        for (const shared_ptr<const Transform>& transform: transforms){
+            size = transform->maxOutput(size);
+        }
+        return size;
+    }
+
+    /*
+    * Appends the end of the blocks, the block index and its checksum to a byte buffer; see encode().
+    * @param output The buffer to append to.
+    * @param blockEnds The end offset of each block, relative to the first block.
+    * @param length The number of bytes of text in all blocks.
+    */
+    static void writeFooter(vector<unsigned char>& output, const vector<uint64_t>& blockEnds, uint64_t length){
+        writeInt(output, 0, 4);
+        size_t start = output.size();
+        for (uint64_t end: blockEnds){
+            writeInt(output, end, 8);
+        }
+        writeInt(output, length, 8);
+        writeInt(output, blockEnds.size(), 4);
+        writeInt(output, crc32c(output.data() + start, output.size() - start), 4);
+    }
+
+    /*
+    * Decides whether a block should reuse the table of an earlier block instead of its fresh one, by estimated cost:
+    * the block's bits with the earlier codes, against its bits with the fresh codes plus the code lengths to store.
+    * @param counts The histogram of the block.
+    * @param fresh The code lengths buildTree() gave the block.
+    * @param current The code lengths of the earlier table.
+    * @return Whether the earlier table is no more expensive; never if it lacks a code for a byte in the block.
+    */
+    static bool reuseTable(const array<uint64_t, 256>& counts, const array<unsigned char, 256>& fresh, const array<unsigned char, 256>& current){
+        uint64_t reuseBits = 0;
+        uint64_t freshBits = 0;
+        int symbols = 0;
+        for (int i = 0; i < 256; i++){
+            if (counts[i] && !current[i]) return false;
+            reuseBits += counts[i] * current[i];
+            freshBits += counts[i] * fresh[i];
+            symbols += fresh[i] != 0;
+        }
+        freshBits += 8 * (2 + (symbols < 128 ? 2 * symbols : 256));
+        return reuseBits <= freshBits;
+    }
+
+    /*
+    * Encodes one block of text, building a table for it unless a shared one is given.
+    * @param data The text of the block.
+    * @param size The number of bytes in data.
+    * @param output Receives the encoded block.
+    * @param shared The tree whose codes every block uses, or nullptr to build a table for this block.
+    */
+    void encodeBlock(const unsigned char* data, size_t size, vector<unsigned char>& output, const HuffmanTree* shared){
+        if (!shared){
+            charCounts.fill(0);
+            addCharFrequencies(data, size);
+            uint64_t cost = lengthLimitCost;
+            buildTree();
+            lengthLimitCost += cost;
+        }
+        writeBlock(data, size, output, shared, 0);
+    }
+
+    /*
+    * Encodes one block of text with the shared codes, or with the current codes (charCounts must match the block).
+    * The block is written as [block length][table distance and code lengths, unless shared][stream count][jump table][streams]
+    * [checksum]; see encode().
+    * @param data The text of the block.
+    * @param size The number of bytes in data.
+    * @param output Receives the encoded block.
+    * @param shared The tree whose codes every block uses, or nullptr to use this tree's codes.
+    * @param distance How many blocks back the block holding the current codes is; 0 stores them in this block.
+    */
+    void writeBlock(const unsigned char* data, size_t size, vector<unsigned char>& output, const HuffmanTree* shared, uint64_t distance){
+        STATS(stats.blocks++);
+        STATS(stats.symbols += size);
+        STATS(stats.tablesReused += distance != 0);
+        output.clear();
+        {
+            STATS(PhaseTimer timer(stats, Stats::header));
+            writeInt(output, size, 4);
+            if (!shared){
+                writeInt(output, distance, 4);
+                if (distance == 0) writeCodeLengths(output);
+            }
+        }
+        int streamCount = min(max(streams, 1), 8);
+        output.push_back(streamCount);
+        size_t jumpTable = output.size();
+        output.resize(jumpTable + 4 * streamCount);
+
+        // reserve room for the longest possible streams, then write them in place
+        const HuffmanTree& table = shared ? *shared : *this;
+        int longest = 0;
+        for (unsigned char length: table.codeLengths){
+            longest = max<int>(longest, length);
+        }
+        uint64_t bits = shared ? uint64_t(size) * longest : encodedBits();
+        size_t streamsStart = output.size();
+        output.resize(streamsStart + BitWriter::capacity(bits) + 8 * streamCount);
+
+        STATS(PhaseTimer timer(stats, Stats::encodeBits));
+        size_t streamEnd = streamsStart;
+        size_t segment = (size + streamCount - 1) / streamCount;
+        for (int stream = 0; stream < streamCount; stream++){
+            size_t start = min(size, stream * segment);
+            BitWriter writer(output.data() + streamEnd);
+            encodeBytes(table.codes.data(), longest, data + start, min(size, start + segment) - start, writer);
+            size_t bytes = writer.finish();
+            streamEnd += bytes;
+            for (int i = 0; i < 4; i++){
+                output[jumpTable + 4 * stream + i] = (bytes >> (8 * i)) & 0xFF;
+            }
+        }
+        output.resize(streamEnd);
+        writeInt(output, crc32c(output.data(), output.size()), 4);
+    }
+
+    /*
+    * Appends the codes for a buffer of text to a bitstream.
+    * As many codes as always fit in the accumulator together are added per store, with the encoder compiled
+    * for that count: 4 codes of up to 14 bits, 3 of up to 18, 2 of up to 28, or 1.
+    * @param codes The code of each byte value.
+    * @param longest The length of the longest code.
+    * @param data The text to encode.
+    * @param size The number of bytes in data.
+    * @param writer The bitstream to append to.
+    */
+    static void encodeBytes(const HuffmanCode* codes, int longest, const unsigned char* data, size_t size, BitWriter& writer){
+        switch (56 / max(longest, 1)){
+            case 1: encodeBytes<1>(codes, data, size, writer); break;
+            case 2: encodeBytes<2>(codes, data, size, writer); break;
+            case 3: encodeBytes<3>(codes, data, size, writer); break;
+            default: encodeBytes<4>(codes, data, size, writer); break;
+        }
+    }
+
+    /*
+    * Appends the codes for a buffer of text to a bitstream, Group codes per store.
+    * Precondition: Group codes of the longest length fit in 56 bits.
+    * @param codes The code of each byte value.
+    * @param data The text to encode.
+    * @param size The number of bytes in data.
+    * @param writer The bitstream to append to.
+    */
+    template <int Group>
+    static void encodeBytes(const HuffmanCode* codes, const unsigned char* data, size_t size, BitWriter& writer){
+        BitWriter local = writer; // byte stores may alias anything, so keep the accumulator out of memory
+        const HuffmanCode* table = codes;
+        size_t i = 0;
+        for (; i + Group <= size; i += Group){
+            for (int code = 0; code < Group; code++){
+                local.add(table[data[i + code]].bits, table[data[i + code]].length);
+            }
+            local.flush();
+        }
+        for (; i < size; i++){
+            local.write(table[data[i]].bits, table[data[i]].length);
+        }
+        writer = local;
+    }
+
+    /*
+    * Import a Huffman coding tree from a file.
+    * The stream should be positioned at the code lengths written by encode(); the canonical codes are rebuilt from them.
+    * @param input The file stream containing the code lengths.
+    */
+    void reconstructTree(istream& input){
+        readCodeLengths(input);
+        reconstructTree();
+    }
+
+    /*
+    * Import a Huffman coding tree from memory.
+    * @param data The bytes starting at the code lengths written by encode().
+    * @param size The number of bytes available.
+    * @return The number of bytes used by the code lengths.
+    */
+    size_t reconstructTree(const unsigned char* data, size_t size){
+        size_t used = readCodeLengths(data, size);
+        reconstructTree();
+        return used;
+    }
+
+    /*
+    * Rebuilds the canonical codes and decodeTable from codeLengths.
+    */
+    void reconstructTree(){
+        STATS(PhaseTimer timer(stats, Stats::table));
+        STATS(stats.tableBuilds++);
+        assignCanonicalCodes();
+        decodeTable.build(codes);
+    }
+    /*
+    * Reads the header of an encoded file; a shared table is loaded into decodeTable.
+    * @param data The start of the file.
+    * @param size The number of bytes available.
+    * @param index Receives the block size, the table mode, the transforms and where the blocks start; a block size of 0
+    *     if the header is incomplete or corrupt, from another format version or names a transform that is unknown.
+    */
+    void readHeader(const unsigned char* data, size_t size, BlockIndex& index){
+        index = BlockIndex();
+        size_t header = measureHeader(data, size);
+        if (header < 14 || memcmp(data, magic, 4) != 0 || data[4] != formatVersion) return;
+        if (crc32c(data, header - 4) != readInt(data + header - 4, 4)) return;
+        index.shared = data[9] & 1;
+        index.blocksStart = 10;
+        if (data[9] & 2){
+            int count = data[10];
+            for (int i = 0; i < count; i++){
+                shared_ptr<const Transform> transform = Transform::find(data[11 + i]);
+                if (!transform) return; // a transform this program does not know
+                index.transforms.push_back(transform);
+            }
+            index.blocksStart += 1 + count;
+        }
+        if (index.shared){
+            readCodeLengths(data + index.blocksStart, header - 4 - index.blocksStart);
+            reconstructTree();
+        }
+        index.blocksStart = header;
+        index.blockSize = readInt(data + 5, 4);
+    }
+
+    /*
+    * Measures the header of an encoded file.
+    * @param data The bytes starting at the header.
+    * @param size The number of bytes available.
+    * @return The number of bytes in the header, or 0 if size is too small to tell. For a file that does not start with
+    *     the magic and formatVersion, the 5 bytes that say so.
+    */
+    static size_t measureHeader(const unsigned char* data, size_t size){
+        if (size < 5) return 0;
+        if (memcmp(data, magic, 4) != 0 || data[4] != formatVersion) return 5;
+        if (size < 10) return 0;
+        size_t used = 10;
+        if (data[9] & 2){
+            if (size < 11 || size < size_t(11) + data[10]) return 0;
+            used += 1 + data[10];
+        }
+        if (data[9] & 1){
+            size_t lengths = codeLengthsSize(data + used, size - used);
+            if (!lengths || size < used + lengths) return 0;
+            used += lengths;
+        }
+        return size < used + 4 ? 0 : used + 4;
+    }
+
+    /*
+    * Measures a block written by encodeBlock() from its own sizes, without the block index.
+    * @param data The bytes starting at the block, or at the end of the blocks.
+    * @param size The number of bytes available.
+    * @param shared Whether the block uses the table in the header.
+    * @return The number of bytes in the block (4 at the end of the blocks), or 0 if size is too small to tell.
+    */
+    static uint64_t measureBlock(const unsigned char* data, size_t size, bool shared){
+        if (size < 4) return 0;
+        if (readInt(data, 4) == 0) return 4;
+        size_t used = 4;
+        if (!shared){
+            if (size < 8) return 0;
+            used = 8;
+            if (tableDistance(data, size) == 0){
+                size_t lengths = codeLengthsSize(data + used, size - used);
+                if (!lengths) return 0;
+                used += lengths;
+            }
+        }
+        if (size < used + 1) return 0;
+        int streamCount = data[used++];
+        if (size < used + 4 * streamCount) return 0;
+        uint64_t total = used + 4 * streamCount + 4; // with the checksum
+        for (int stream = 0; stream < streamCount; stream++){
+            total += readInt(data + used + 4 * stream, 4);
+        }
+        return total;
+    }
+
+    /*
+    * @param data An encoded block, ending with its checksum.
+    * @param size The number of bytes in data.
+    * @return Whether the checksum matches the rest of the block.
+    */
+    static bool checksumMatches(const unsigned char* data, size_t size){
+        return size >= 4 && crc32c(data, size - 4) == readInt(data + size - 4, 4);
+    }
+
+    /*
+    * Reads the header and block index of an encoded file held in memory.
+    * @param data The whole file.
+    * @param size The size of the file.
+    * @param index Receives the layout of the file; it has no blocks if the file is too short or corrupt.
+    */
+    void readBlockIndex(const unsigned char* data, size_t size, BlockIndex& index){
+        readHeader(data, size, index);
+        if (size < index.blocksStart + 20) return;
+        size_t blockCount = readInt(data + size - 8, 4);
+        if (blockCount > (size - index.blocksStart - 20) / 8) return;
+        index.readFooter(data + size - 20 - 8 * blockCount, blockCount, size - 20 - 8 * blockCount);
+    }
+
+    /*
+    * Reads the header and block index of an encoded file without reading its blocks.
+    * @param input The encoded file.
+    * @param index Receives the layout of the file; it has no blocks if the file is too short or corrupt.
+    */
+    void readBlockIndex(istream& input, BlockIndex& index){
+        input.seekg(0, ios::end);
+        uint64_t size = input ? uint64_t(input.tellg()) : 0;
+        vector<unsigned char> bytes(min<uint64_t>(size, 10 + 1 + 255 + 2 + 256 + 4));
+        input.seekg(0);
+        input.read((char*)bytes.data(), bytes.size());
+        readHeader(bytes.data(), input.gcount(), index);
+        if (size < index.blocksStart + 20) return;
+
+        bytes.resize(4);
+        input.seekg(size - 8);
+        input.read((char*)bytes.data(), 4);
+        size_t blockCount = readInt(bytes.data(), 4);
+        if (blockCount > (size - index.blocksStart - 20) / 8) return;
+        bytes.resize(8 * blockCount + 20);
+        input.seekg(size - bytes.size());
+        input.read((char*)bytes.data(), bytes.size());
+        index.readFooter(bytes.data(), blockCount, size - bytes.size());
+    }
+
+    /*
+    * Import the Huffman coding trees given tree mappings and encoded text. Then, decode and export the text.
+    * Blocks are decoded concurrently by a thread pool, one batch at a time, and written in order.
+    * The file is read into memory (or mapped, with useMemoryMap, in which case the output is mapped as well
+    * and every block is decoded straight into place).
+    * Blocks that fail their checksum or cannot be decoded are written as zeros and counted in corruptBlocks.
+    * @param fileName The name of the file written by encode() containing the blocks and the block index.
+    * @return Whether the file was intact and the output written, so that the output is the original text;
+    *     writeFailed tells the two failures apart.
+    */
+    bool decode(string fileName){
+        STATS(PhaseTimer timer(stats, Stats::total));
+        int index = 0;
+        while (fileName.find('.', index+1) != -1){
+            index = fileName.find('.', index+1);
+        }
+        outputName = fileName.substr(0, index) + "_decoded.txt";
+        writeFailed = false;
+
+        MappedFile mappedInput;
+        size_t size;
+        const unsigned char* data = loadFile(fileName, mappedInput, size);
+        BlockIndex blocks;
+        readBlockIndex(data, size, blocks);
+
+        ThreadPool pool(threads);
+        vector<HuffmanTree>& workers = decodeWorkers(pool);
+        size_t batchBlocks = 2 * pool.size();
+        MappedFile mappedOutput;
+        ofstream output;
+        vector<unsigned char>& text = outputBuffer;
+        size_t batchBytes = min<uint64_t>(blocks.length, batchBlocks * blocks.blockSize);
+        if (!useMemoryMap || !mappedOutput.create(outputName, blocks.length)){
+            output.open(outputName, ios::binary);
+            if (!output){
+                writeFailed = true;
+                corruptBlocks = 0;
+                return false;
+            }
+            text.resize((pipelined ? 2 : 1) * batchBytes);
+        }
+
+        // decode binary one batch of blocks at a time; with pipelined, each batch is written on an I/O thread from
+        // one half of text while the next is decoded into the other
+        const DecodeTable* shared = blocks.shared ? &decodeTable : nullptr;
+        Stats ioStats; // of the writes, merged when they are done
+        BackgroundTask writer(pipelined);
+        for (size_t first = 0, set = 0; first < blocks.blockCount(); first += batchBlocks, set ^= pipelined){
+            size_t count = min(batchBlocks, blocks.blockCount() - first);
+            unsigned char* batchText = text.data() + set * batchBytes;
+            pool.run(count, [&](size_t i, int worker){
+                size_t block = first + i;
+                unsigned char* blockOutput = mappedOutput.data ? mappedOutput.data + block * blocks.blockSize : batchText + i * blocks.blockSize;
+                workers[worker].corruptBlocks += !workers[worker].decodeFileBlock(data, blocks, block, blockOutput, shared);
+            });
+            if (!mappedOutput.data){
+                size_t bytes = (count - 1) * blocks.blockSize + blocks.blockLength(first + count - 1);
+                writer.run([&output, &ioStats, batchText, bytes](){
+                    STATS(PhaseTimer timer(ioStats, Stats::io));
+                    output.write((const char*)batchText, bytes);
+                });
+            }
+        }
+        writer.wait();
+        STATS(stats.add(ioStats));
+        STATS(stats.bytesIn += size);
+        STATS(stats.bytesOut += blocks.length);
+        if (output.is_open()){
+            writeFailed = !output;
+            output.close();
+            writeFailed |= !output;
+        }
+        return finishDecode(blocks) && !writeFailed;
+    }
+
+    /*
+    * Reads the exact size of the text of an encoded file from its footer, without decoding it, so that a buffer for
+    * decode() can be allocated up front.
+    * @param data The encoded file.
+    * @param size The size of the file.
+    * @return The number of bytes decode() writes; 0 if the file is empty or its header or footer is corrupt.
+    */
+    uint64_t decodedSize(const unsigned char* data, size_t size){
+        BlockIndex blocks;
+        readBlockIndex(data, size, blocks);
+        return blocks.intact ? blocks.length : 0;
+    }
+
+    /*
+    * Like decodedSize() for a file on disk, reading only its header and footer.
+    * @param fileName The name of the file written by encode().
+    * @return The number of bytes decode() writes; 0 if the file is empty or its header or footer is corrupt.
+    */
+    uint64_t decodedSize(string fileName){
+        ifstream input(fileName, ios::binary);
+        BlockIndex blocks;
+        readBlockIndex(input, blocks);
+        return blocks.intact ? blocks.length : 0;
+    }
+
+    /*
+    * Decodes an encoded file held in memory straight into the caller's buffer; the text is never staged anywhere
+    * else. Blocks are decoded concurrently, each into its place.
+    * @param data The encoded file.
+    * @param size The size of the file.
+    * @param output The destination, with room for decodedSize() bytes.
+    * @param capacity The number of bytes output has room for.
+    * @return Whether the file was intact and fit; if it did not fit, nothing is written.
+    */
+    bool decode(const unsigned char* data, size_t size, unsigned char* output, size_t capacity){
+        STATS(PhaseTimer timer(stats, Stats::total));
+        iovec buffer = {output, capacity};
+        return decodeScattered(data, size, &buffer, 1);
+    }
+
+    /*
+    * Decodes an encoded file held in memory into a list of buffers filled in order as if they were one, like readv(),
+    * so that the text can go out through writev() or sendmsg() in pieces the caller chose.
+    * @param data The encoded file.
+    * @param size The size of the file.
+    * @param buffers The destinations.
+    * @param count The number of buffers.
+    * @return Whether the file was intact and fit; if it did not fit, nothing is written.
+    */
+    bool decode(const unsigned char* data, size_t size, const iovec* buffers, size_t count){
+        STATS(PhaseTimer timer(stats, Stats::total));
+        return decodeScattered(data, size, buffers, count);
+    }
+
+    /*
+    * Like decode() for a buffer, reading the encoded file first (mapped, with useMemoryMap).
+    * @param fileName The name of the file written by encode().
+    * @param output The destination, with room for decodedSize() bytes.
+    * @param capacity The number of bytes output has room for.
+    * @return Whether the file was intact and fit; if it did not fit, nothing is written.
+    */
+    bool decode(string fileName, unsigned char* output, size_t capacity){
+        iovec buffer = {output, capacity};
+        return decode(fileName, &buffer, 1);
+    }
+
+    /*
+    * Like decode() for a list of buffers, reading the encoded file first (mapped, with useMemoryMap).
+    * @param fileName The name of the file written by encode().
+    * @param buffers The destinations.
+    * @param count The number of buffers.
+    * @return Whether the file was intact and fit; if it did not fit, nothing is written.
+    */
+    bool decode(string fileName, const iovec* buffers, size_t count){
+        STATS(PhaseTimer timer(stats, Stats::total));
+        MappedFile mappedInput;
+        size_t size;
+        const unsigned char* data = loadFile(fileName, mappedInput, size);
+        return decodeScattered(data, size, buffers, count);
+    }
+
+    /*
+    * Decodes an encoded file held in memory into a list of buffers; see decode().
+    * A block that lies within one buffer is decoded straight into it. One that straddles buffers is decoded into
+    * its worker's outputBuffer and copied out in pieces, so only those blocks are copied.
+    * @param data The encoded file.
+    * @param size The size of the file.
+    * @param buffers The destinations.
+    * @param count The number of buffers.
+    * @return Whether the file was intact and fit.
+    */
+    bool decodeScattered(const unsigned char* data, size_t size, const iovec* buffers, size_t count){
+        BlockIndex blocks;
+        readBlockIndex(data, size, blocks);
+        vector<uint64_t> starts(count + 1); // offset in the text of each buffer
+        for (size_t i = 0; i < count; i++){
+            starts[i + 1] = starts[i] + buffers[i].iov_len;
+        }
+        corruptBlocks = 0;
+        if (starts[count] < blocks.length) return false;
+
+        ThreadPool pool(threads);
+        vector<HuffmanTree>& workers = decodeWorkers(pool);
+        const DecodeTable* shared = blocks.shared ? &decodeTable : nullptr;
+        pool.run(blocks.blockCount(), [&](size_t block, int worker){
+            HuffmanTree& tree = workers[worker];
+            uint64_t start = block * blocks.blockSize;
+            size_t length = blocks.blockLength(block);
+            size_t buffer = upper_bound(starts.begin(), starts.end(), start) - starts.begin() - 1; // skips empty buffers
+            if (start + length <= starts[buffer + 1]){
+                unsigned char* place = (unsigned char*)buffers[buffer].iov_base + (start - starts[buffer]);
+                tree.corruptBlocks += !tree.decodeFileBlock(data, blocks, block, place, shared);
+                return;
+            }
+            tree.outputBuffer.resize(length);
+            tree.corruptBlocks += !tree.decodeFileBlock(data, blocks, block, tree.outputBuffer.data(), shared);
+            for (size_t copied = 0; copied < length; buffer++){
+                size_t offset = start + copied - starts[buffer];
+                size_t piece = min<uint64_t>(length - copied, buffers[buffer].iov_len - offset);
+                memcpy((unsigned char*)buffers[buffer].iov_base + offset, tree.outputBuffer.data() + copied, piece);
+                copied += piece;
+            }
+        });
+        STATS(stats.bytesIn += size);
+        STATS(stats.bytesOut += blocks.length);
+        return finishDecode(blocks);
+    }
+
+    /*
+    * Sizes workerTrees for a pool that decodes a file, and resets what they kept from the last file.
+    * @param pool The pool whose threads the workers belong to.
+    * @return The workers, one per thread.
+    */
+    vector<HuffmanTree>& decodeWorkers(const ThreadPool& pool){
+        workerTrees.resize(pool.size());
+        for (HuffmanTree& worker: workerTrees){
+            worker.loadedTableBlock = UINT64_MAX; // block numbers of the last file mean nothing here
+            worker.verifyChecksums = verifyChecksums;
+            worker.corruptBlocks = 0;
+        }
+        return workerTrees;
+    }
+
+    /*
+    * Merges the stats and corrupt block counts of the workers into this tree once they have decoded a file.
+    * @param blocks The layout of the file.
+    * @return Whether the file was intact.
+    */
+    bool finishDecode(const BlockIndex& blocks){
+        collectWorkerStats();
+        corruptBlocks = 0;
+        for (const HuffmanTree& worker: workerTrees){
+            corruptBlocks += worker.corruptBlocks;
+        }
+        return blocks.intact && corruptBlocks == 0;
+    }
+
+    /*
+    * Checks an encoded file without decoding it: the header, the footer and their checksums, the block index against
+    * the sizes the blocks carry themselves, and every block's checksum. Blocks are checked concurrently.
+    * This reads the file once and runs at the speed of crc32c(), far faster than decoding.
+    * @param fileName The name of the file written by encode().
+    * @return Whether the file is intact; corruptBlocks receives the number of blocks that are not, counting those
+    *     that reuse the table of a corrupt block.
+    */
+    bool verify(string fileName){
+        STATS(PhaseTimer timer(stats, Stats::total));
+        MappedFile mappedInput;
+        size_t size;
+        const unsigned char* data = loadFile(fileName, mappedInput, size);
+        BlockIndex blocks;
+        readBlockIndex(data, size, blocks);
+        corruptBlocks = 0;
+        STATS(stats.bytesIn += size);
+        if (!blocks.intact) return false;
+
+        ThreadPool pool(threads);
+        vector<char> intact(blocks.blockCount());
+        pool.run(blocks.blockCount(), [&](size_t block, int){
+            intact[block] = checkBlock(data, blocks, block);
+        });
+
+        // checkBlock() has made sure every table reference lands on an earlier block
+        for (size_t block = 0; block < blocks.blockCount(); block++){
+            uint64_t start = blocks.blockStart(block);
+            uint64_t distance = blocks.shared || !intact[block] ? 0 : tableDistance(data + start, blocks.ends[block] - start);
+            corruptBlocks += !intact[block] || (distance && !intact[block - distance]);
+        }
+        STATS(stats.blocks += blocks.blockCount());
+        return corruptBlocks == 0;
+    }
+
+    /*
+    * Checks one block of an encoded file without decoding it.
+    * @param file The encoded file.
+    * @param blocks The layout of the file.
+    * @param block The number of the block.
+    * @return Whether the block's sizes agree with the index, its checksum matches,
+    *     and the table it reuses, if any, is stored in an earlier block.
+    */
+    static bool checkBlock(const unsigned char* file, const BlockIndex& blocks, size_t block){
+        uint64_t start = blocks.blockStart(block);
+        const unsigned char* data = file + start;
+        size_t size = blocks.ends[block] - start;
+        if (measureBlock(data, size, blocks.shared) != size || !checksumMatches(data, size)) return false;
+        uint64_t coded = readInt(data, 4);
+        bool lengthFits = blocks.transforms.empty() ? coded == blocks.blockLength(block) : coded <= transformedSize(blocks.transforms, blocks.blockSize);
+        if (!lengthFits) return false;
+        uint64_t distance = blocks.shared ? 0 : tableDistance(data, size);
+        if (!distance) return true;
+        if (distance > block) return false;
+        uint64_t tableStart = blocks.blockStart(block - distance);
+        return tableDistance(file + tableStart, blocks.ends[block - distance] - tableStart) == 0;
+    }
+
+    /*
+    * Gets the bytes of an encoded file: mapped, with useMemoryMap, or else read into inputBuffer.
+    * @param fileName The name of the file.
+    * @param mapped Receives the mapping, if the file is mapped.
+    * @param size Receives the size of the file.
+    * @return The bytes of the file.
+    */
+    const unsigned char* loadFile(const string& fileName, MappedFile& mapped, size_t& size){
+        if (useMemoryMap && mapped.openRead(fileName)){
+            size = mapped.size;
+            return mapped.data;
+        }
+        STATS(PhaseTimer timer(stats, Stats::io));
+        ifstream input(fileName, ios::binary | ios::ate);
+        inputBuffer.resize(input ? uint64_t(input.tellg()) : 0);
+        input.seekg(0);
+        input.read((char*)inputBuffer.data(), inputBuffer.size());
+        inputBuffer.resize(input.gcount());
+        size = inputBuffer.size();
+        return inputBuffer.data();
+    }
+
+    /*
+    * Decodes only the bytes [offset, offset + length) of an encoded file.
+    * The block index is read first, then only the blocks that overlap the range are read and decoded,
+    * concurrently when there are several of them.
+    * @param fileName The name of the file written by encode().
+    * @param offset The position in the original text of the first byte to decode.
+    * @param length The number of bytes to decode; the range is cut short at the end of the text.
+    * @return The decoded bytes; blocks that fail their checksum are zeros, and counted in corruptBlocks.
+    */
+    vector<unsigned char> decodeRange(string fileName, uint64_t offset, uint64_t length){
+        MappedFile mappedInput;
+        ifstream input;
+        BlockIndex blocks;
+        if (useMemoryMap && mappedInput.openRead(fileName)){
+            readBlockIndex(mappedInput.data, mappedInput.size, blocks);
+        } else {
+            input.open(fileName, ios::binary);
+            readBlockIndex(input, blocks);
+        }
+        corruptBlocks = 0;
+        if (offset >= blocks.length || length == 0) return {};
+        length = min(length, blocks.length - offset);
+        size_t first = offset / blocks.blockSize;
+        size_t last = (offset + length - 1) / blocks.blockSize;
+
+        // read the encoded blocks in one piece, unless they are mapped already
+        uint64_t start = blocks.blockStart(first);
+        vector<unsigned char> encoded;
+        const unsigned char* data = mappedInput.data;
+        if (!data){
+            encoded.resize(blocks.ends[last] - start);
+            input.clear();
+            input.seekg(start);
+            input.read((char*)encoded.data(), encoded.size());
+            data = encoded.data() - start; // indexed by file offset like a mapping
+        }
+
+        vector<unsigned char> text((last - first + 1) * blocks.blockSize);
+        ThreadPool pool(min<size_t>(threads > 0 ? threads : thread::hardware_concurrency(), last - first + 1));
+        vector<HuffmanTree> workers(pool.size());
+        const DecodeTable* shared = blocks.shared ? &decodeTable : nullptr;
+
+        // the first block may reuse the table of a block before the range, which was not read; load it into
+        // every worker up front. Only blocks before the range's first stored table reuse it, and each worker
+        // takes blocks in increasing order, so no worker replaces it while another block still needs it.
+        uint64_t distance = shared ? 0 : tableDistance(data + start, blocks.ends[first] - start);
+        for (HuffmanTree& worker: workers){
+            worker.verifyChecksums = verifyChecksums;
+        }
+        if (!mappedInput.data && distance && distance <= first){
+            size_t tableBlock = first - distance;
+            uint64_t tableStart = blocks.blockStart(tableBlock);
+            vector<unsigned char> table(blocks.ends[tableBlock] - tableStart); // whole, for its checksum
+            input.seekg(tableStart);
+            input.read((char*)table.data(), table.size());
+            for (HuffmanTree& worker: workers){
+                worker.loadBlockTable(table.data(), input.gcount(), tableBlock);
+            }
+        }
+        pool.run(last - first + 1, [&](size_t i, int worker){
+            workers[worker].corruptBlocks += !workers[worker].decodeFileBlock(data, blocks, first + i, text.data() + i * blocks.blockSize, shared,
+                mappedInput.data ? 0 : start);
+        });
+        corruptBlocks = 0;
+        for (HuffmanTree& worker: workers){
+            stats.add(worker.stats);
+            corruptBlocks += worker.corruptBlocks;
+        }
+        size_t skip = offset - first * blocks.blockSize;
+        return vector<unsigned char>(text.begin() + skip, text.begin() + skip + length);
+    }
+
+    /*
+    * Decodes block number block of an encoded file, finding the table it reuses if it has none of its own.
+    * @param file The encoded file, or any buffer indexed by file offset that holds the block and the table it reuses.
+    * @param blocks The layout of the file.
+    * @param block The number of the block.
+    * @param output The destination, with room for the text of the block.
+    * @param shared The table every block uses, or nullptr if the blocks have their own tables.
+    * @param readable The first file offset file holds; a table stored before it is only used if it is loaded already.
+    * @return Whether the block was intact; if not, output is filled with zeros.
+    */
+    bool decodeFileBlock(const unsigned char* file, const BlockIndex& blocks, size_t block, unsigned char* output, const DecodeTable* shared, uint64_t readable = 0){
+        uint64_t start = blocks.blockStart(block);
+        const unsigned char* data = file + start;
+        size_t size = blocks.ends[block] - start;
+        size_t length = blocks.blockLength(block);
+        if (verifyChecksums && !checksumMatches(data, size)){
+            memset(output, 0, length);
+            return false;
+        }
+        uint64_t distance = shared ? 0 : tableDistance(data, size);
+        const DecodeTable* earlier = nullptr;
+        if (distance && distance <= block){
+            size_t tableBlock = block - distance;
+            uint64_t tableStart = blocks.blockStart(tableBlock);
+            if (tableStart >= readable){
+                earlier = loadBlockTable(file + tableStart, blocks.ends[tableBlock] - tableStart, tableBlock);
+            } else if (loadedTableBlock == tableBlock){
+                earlier = &decodeTable;
+            }
+        }
+        bool intact;
+        if (blocks.transforms.empty()){
+            intact = decodeBlock(data, size, output, length, shared, earlier) && readInt(data, 4) == length;
+        } else {
+            intact = untransformBlock(data, size, blocks, shared, earlier) && transformed.size() == length;
+            if (intact) memcpy(output, transformed.data(), length);
+        }
+        if (!intact) memset(output, 0, length); // corrupt
+        if (!shared && !distance) loadedTableBlock = block;
+        return intact;
+    }
+
+    /*
+    * Decodes one block of a file with transforms into transformed, then runs the inverses of the transforms on it
+    * in reverse order.
+    * @param data The encoded block.
+    * @param size The number of bytes in data.
+    * @param blocks The layout of the file, with its transforms.
+    * @param shared The table every block uses, or nullptr if the blocks have their own tables.
+    * @param earlier The table of the earlier block this block reuses, if it reuses one.
+    * @return Whether the block is intact; transformed then holds its text.
+    */
+    bool untransformBlock(const unsigned char* data, size_t size, const BlockIndex& blocks, const DecodeTable* shared, const DecodeTable* earlier){
+        uint64_t coded = size < 4 ? 0 : readInt(data, 4);
+        transformed.clear();
+        if (coded > transformedSize(blocks.transforms, blocks.blockSize)) return false;
+        transformed.resize(coded);
+        bool intact = decodeBlock(data, size, transformed.data(), coded, shared, earlier);
+        STATS(PhaseTimer timer(stats, Stats::transform));
+        for (size_t i = blocks.transforms.size(); i-- > 0;){
+            intact = intact && blocks.transforms[i]->inverse(transformed.data(), transformed.size(), transformStage, arena);
+            transformed.swap(transformStage);
+        }
+        return intact && transformed.size() <= blocks.blockSize;
+    }
+
+    /*
+    * Reads how many blocks back the block holding a block's table is.
+    * @param data The encoded block, from a file without a shared table.
+    * @param size The number of bytes in data.
+    * @return The distance, or 0 if the block holds its own table.
+    */
+    static uint64_t tableDistance(const unsigned char* data, size_t size){
+        return size < 8 ? 0 : readInt(data + 4, 4);
+    }
+
+    /*
+    * Loads the table stored in a block into decodeTable, unless it holds that table already.
+    * @param data The encoded block holding the table.
+    * @param size The number of bytes in data.
+    * @param block The number of that block.
+    * @return The loaded table, or nullptr if the block reuses a table itself instead of storing one,
+    *     or fails its checksum with verifyChecksums.
+    */
+    const DecodeTable* loadBlockTable(const unsigned char* data, size_t size, uint64_t block){
+        if (loadedTableBlock != block){
+            if (tableDistance(data, size) || (verifyChecksums && !checksumMatches(data, size))) return nullptr;
+            size_t used = min<size_t>(8, size);
+            readCodeLengths(data + used, size - used);
+            reconstructTree();
+            loadedTableBlock = block;
+        }
+        return &decodeTable;
+    }
+
+    /*
+    * Decodes one block written by writeBlock().
+    * @param data The encoded block.
+    * @param size The number of bytes in data.
+    * @param output The destination, with room for length bytes.
+    * @param length The number of bytes of text in the block.
+    * @param shared The table every block uses, or nullptr if the blocks have their own tables.
+    * @param earlier The table of the earlier block this block reuses, if it reuses one.
+    * @return Whether the block was well formed: it had a table to decode with, and its streams end at its checksum.
+    *     If it had no table, output is filled with zeros.
+    */
+    bool decodeBlock(const unsigned char* data, size_t size, unsigned char* output, size_t length, const DecodeTable* shared, const DecodeTable* earlier = nullptr){
+        size_t used = min<size_t>(4, size); // the block length; the caller knows it already
+        if (!shared){
+            uint64_t distance = tableDistance(data, size);
+            used = min<size_t>(8, size);
+            if (distance == 0){
+                used += readCodeLengths(data + used, size - used);
+                reconstructTree();
+                loadedTableBlock = UINT64_MAX;
+                earlier = &decodeTable;
+            }
+            shared = earlier;
+        }
+        if (!shared){
+            memset(output, 0, length); // the reused table is missing
+            return false;
+        }
+        int streamCount = used < size ? data[used++] : 0;
+        if (shared->rootBits == 0 || streamCount < 1 || streamCount > 8 || used + 4 * streamCount > size){
+            memset(output, 0, length); // no codes to decode with
+            return false;
+        }
+
+        // locate the streams through the jump table
+        const unsigned char* jumpTable = data + used;
+        used += 4 * streamCount;
+        BitReader readers[8];
+        size_t lengths[8];
+        size_t segment = (length + streamCount - 1) / streamCount;
+        for (int stream = 0; stream < streamCount; stream++){
+            size_t bytes = min<size_t>(readInt(jumpTable + 4 * stream, 4), size - used);
+            readers[stream] = BitReader(data + used, bytes);
+            used += bytes;
+            lengths[stream] = min(length, (stream + 1) * segment) - min(length, stream * segment);
+        }
+
+        STATS(stats.blocks++);
+        STATS(stats.symbols += length);
+        STATS(PhaseTimer timer(stats, Stats::decodeBits));
+        switch (streamCount){
+            case 1: decodeStreams<1>(*shared, readers, output, segment, lengths); break;
+            case 2: decodeStreams<2>(*shared, readers, output, segment, lengths); break;
+            case 3: decodeStreams<3>(*shared, readers, output, segment, lengths); break;
+            case 4: decodeStreams<4>(*shared, readers, output, segment, lengths); break;
+            case 5: decodeStreams<5>(*shared, readers, output, segment, lengths); break;
+            case 6: decodeStreams<6>(*shared, readers, output, segment, lengths); break;
+            case 7: decodeStreams<7>(*shared, readers, output, segment, lengths); break;
+            case 8: decodeStreams<8>(*shared, readers, output, segment, lengths); break;
+        }
+        return used + 4 == size;
+    }
+
+    /*
+    * Decodes Streams interleaved bitstreams with the decoder compiled for the table's length class (see DecodeTable::lengthClass()).
+    * @param table The lookup table for the block's codes.
+    * @param readers One bitstream per stream.
+    * @param output The destination; stream i fills output[i * segment, i * segment + lengths[i]).
+    * @param segment The distance between the starts of consecutive segments.
+    * @param lengths The number of symbols in each stream.
+    */
+    template <int Streams>
+    void decodeStreams(const DecodeTable& table, BitReader* readers, unsigned char* output, size_t segment, const size_t* lengths){
+        switch (table.lengthClass()){
+            case DecodeTable::lengthClasses[0]: decodeStreams<Streams, DecodeTable::lengthClasses[0]>(table, readers, output, segment, lengths); break;
+            case DecodeTable::lengthClasses[1]: decodeStreams<Streams, DecodeTable::lengthClasses[1]>(table, readers, output, segment, lengths); break;
+            case DecodeTable::lengthClasses[2]: decodeStreams<Streams, DecodeTable::lengthClasses[2]>(table, readers, output, segment, lengths); break;
+            case DecodeTable::lengthClasses[3]: decodeStreams<Streams, DecodeTable::lengthClasses[3]>(table, readers, output, segment, lengths); break;
+            case DecodeTable::lengthClasses[4]: decodeStreams<Streams, DecodeTable::lengthClasses[4]>(table, readers, output, segment, lengths); break;
+            default: decodeStreams<Streams, DecodeTable::lengthClasses[5]>(table, readers, output, segment, lengths); break;
+        }
+    }
+
+    /*
+    * Decodes Streams interleaved bitstreams into consecutive segments of output.
+    * While every stream still has symbols left, one symbol of each is decoded per step; the lookups
+    * for different streams do not depend on each other, so the CPU can overlap them. Each refill is
+    * followed by as many steps as the reservoir is guaranteed to have bits for; with the bound on the codes
+    * fixed at compile time, that count is a constant and the steps unroll.
+    * @param table The lookup table for the block's codes, whose length class is MaxLength.
+    * @param readers One bitstream per stream.
+    * @param output The destination; stream i fills output[i * segment, i * segment + lengths[i]).
+    * @param segment The distance between the starts of consecutive segments.
+    * @param lengths The number of symbols in each stream.
+    */
+    template <int Streams, int MaxLength>
+    void decodeStreams(const DecodeTable& table, BitReader* readers, unsigned char* output, size_t segment, const size_t* lengths){
+        size_t together = lengths[Streams - 1]; // the last segment is the shortest
+        BitReader local[Streams]; // byte stores may alias anything, so keep the reservoirs out of memory
+        for (int stream = 0; stream < Streams; stream++){
+            local[stream] = readers[stream];
+        }
+        size_t i = 0;
+        constexpr size_t steps = 56 / MaxLength; // a refill leaves at least 56 bits
+        const uint32_t* entries = table.data();
+        int rootBits = table.rootBits;
+        for (; i + steps <= together; i += steps){
+            for (int stream = 0; stream < Streams; stream++){
+                local[stream].refill();
+            }
+            for (size_t step = 0; step < steps; step++){
+                for (int stream = 0; stream < Streams; stream++){
+                    output[stream * segment + i + step] = DecodeTable::lookup<MaxLength>(entries, rootBits, local[stream]);
+                }
+            }
+        }
+        for (; i < together; i++){
+            for (int stream = 0; stream < Streams; stream++){
+                output[stream * segment + i] = table.decodeSymbol(local[stream]);
+            }
+        }
+        for (int stream = 0; stream < Streams; stream++){
+            readers[stream] = local[stream];
+        }
+        for (int stream = 0; stream < Streams; stream++){
+            decodeBytes(table, readers[stream], output + stream * segment + together, lengths[stream] - together);
+        }
+    }
+
+    /*
+    * Decodes a number of symbols from a bitstream into memory.
+    * @param table The lookup table for the current codes.
+    * @param reader The bitstream positioned at the next code.
+    * @param output The destination, with room for count bytes.
+    * @param count The number of symbols to decode.
+    */
+    static void decodeBytes(const DecodeTable& table, BitReader& reader, unsigned char* output, size_t count){
+        BitReader local = reader; // byte stores may alias anything, so keep the reservoir out of memory
+        for (size_t i = 0; i < count; i++){
+            output[i] = table.decodeSymbol(local);
+        }
+        reader = local;
+    }
+};
+
+/*
+* A code table trained offline by HuffmanTree::trainStaticTable() and shared by many small messages, which then
+* carry only the table's ID instead of their own code lengths.
+* Message format: [table ID: 4 bytes][text length: 4 bytes][codes, packed MSB-first and padded to a whole byte]
+* A loaded table is used in place, from a mapped file or the caller's buffer, unless it is misaligned or the
+* host is big-endian; then it is copied once.
+*/
+struct StaticTable{
+    uint32_t id = 0;
+    const HuffmanCode* codes = nullptr; // code of each byte value; every byte value has one
+    int longest = 0; // length of the longest code
+    DecodeTable decodeTable;
+    array<HuffmanCode, 256> copiedCodes; // the codes, when the table cannot be used in place
+    MappedFile file; // the table file, when it was opened with open()
+
+    /*
+    * Maps a table file and loads it in place.
+    * @param fileName The name of the file written by HuffmanTree::trainStaticTable().
+    * @return Whether the file holds a valid table.
+    */
+    bool open(const string& fileName){
+        return file.openRead(fileName) && load(file.data, file.size);
+    }
+
+    /*
+    * Loads a table written by HuffmanTree::writeStaticTable(). The data must outlive the table.
+    * @param data The serialized table.
+    * @param size The number of bytes in data.
+    * @return Whether the data holds a valid table.
+    */
+    bool load(const unsigned char* data, size_t size){
+        static_assert(sizeof(HuffmanCode) == 8, "HuffmanCode must match the serialized codes");
+        codes = nullptr;
+        if (size < 16 + 256 * 8) return false;
+        id = readInt(data, 4);
+        int rootBits = readInt(data + 4, 4);
+        int maxLength = readInt(data + 8, 4);
+        uint64_t entryCount = readInt(data + 12, 4);
+        const unsigned char* entries = data + 16 + 256 * 8;
+        if (rootBits < 1 || rootBits > DecodeTable::maxRootBits || maxLength > 32 || entryCount < (uint64_t(1) << rootBits)
+            || entryCount > (size - 16 - 256 * 8) / 4) return false;
+
+        // every link must stay inside the entries, or a lookup could read past them
+        for (uint64_t i = 0; i < entryCount; i++){
+            uint32_t entry = readInt(entries + 4 * i, 4);
+            int bits = entry & 0xFF;
+            if ((entry & DecodeTable::linkFlag) && (bits < 1 || bits > DecodeTable::maxRootBits
+                || ((entry & ~DecodeTable::linkFlag) >> 8) + (uint64_t(1) << bits) > entryCount)) return false;
+        }
+
+        bool inPlace = uintptr_t(data) % 4 == 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        inPlace = false;
+#endif
+        if (inPlace){
+            codes = (const HuffmanCode*)(data + 16);
+            decodeTable.mapped = (const uint32_t*)entries;
+        } else {
+            for (int i = 0; i < 256; i++){
+                copiedCodes[i].bits = readInt(data + 16 + 8 * i, 4);
+                copiedCodes[i].length = data[16 + 8 * i + 4];
+            }
+            codes = copiedCodes.data();
+            decodeTable.entries.resize(entryCount);
+            for (uint64_t i = 0; i < entryCount; i++){
+                decodeTable.entries[i] = readInt(entries + 4 * i, 4);
+            }
+            decodeTable.mapped = nullptr;
+        }
+        decodeTable.rootBits = rootBits;
+        decodeTable.maxLength = maxLength;
+        longest = 0;
+        for (int i = 0; i < 256; i++){
+            if (codes[i].length == 0 || codes[i].length > maxLength){
+                codes = nullptr; // a byte value without a usable code
+                return false;
+            }
+            longest = max<int>(longest, codes[i].length);
+        }
+        return true;
+    }
+
+    /*
+    * Encodes one message with the table.
+    * @param data The text of the message.
+    * @param size The number of bytes in data.
+    * @param output Receives the encoded message.
+    */
+    void encode(const unsigned char* data, size_t size, vector<unsigned char>& output) const {
+        output.resize(8 + BitWriter::capacity(uint64_t(size) * longest));
+        for (int i = 0; i < 4; i++){
+            output[i] = (id >> (8 * i)) & 0xFF;
+            output[4 + i] = (size >> (8 * i)) & 0xFF;
+        }
+        BitWriter writer(output.data() + 8);
+        HuffmanTree::encodeBytes(codes, longest, data, size, writer);
+        output.resize(8 + (writer.output - writer.start) + (writer.used + 7) / 8);
+    }
+
+    /*
+    * Decodes one message encoded with the table.
+    * @param data The encoded message.
+    * @param size The number of bytes in data.
+    * @param output Receives the text of the message.
+    * @return Whether the message was encoded with this table and is not truncated.
+    */
+    bool decode(const unsigned char* data, size_t size, vector<unsigned char>& output) const {
+        output.clear();
+        if (!codes || size < 8 || messageTable(data, size) != id) return false;
+        uint64_t length = readInt(data + 4, 4);
+        if (length > 8 * (size - 8)) return false; // every code has at least one bit
+        output.resize(length);
+        BitReader reader(data + 8, size - 8);
+        HuffmanTree::decodeBytes(decodeTable, reader, output.data(), length);
+        return 8 * reader.position - reader.count <= 8 * (size - 8); // the codes did not run past the message
+    }
+
+    /*
+    * Reads which table a message was encoded with, so the caller can pick the table to decode it with.
+    * @param data The encoded message.
+    * @param size The number of bytes in data.
+    * @return The table ID, or 0 if the message is too short to have one.
+    */
+    static uint32_t messageTable(const unsigned char* data, size_t size){
+        return size < 4 ? 0 : readInt(data, 4);
+    }
+};
+
+/*
+* Encodes a stream of bytes piece by piece into the format written by HuffmanTree::encode(), for text that is
+* not in a file (pipes, network messages). Text is buffered until a block is full; the block is then encoded
+* with its own table (or the last one, see reuseTables) and passed to the sink, so memory stays within about two
+* blocks plus the block index.
+* Options (blockSize, maxCodeLength, streams, reuseTables) are set on tree before the first update(). sharedTable is
+* ignored: a shared table needs the whole text before the first block.
+*/
+struct HuffmanEncoder{
+    HuffmanTree tree; // options and per-block state
+    function<void(const unsigned char*, size_t)> sink; // receives the encoded bytes in order
+    vector<unsigned char> pending; // text of the block being filled
+    vector<unsigned char> encoded; // the last encoded block
+    vector<uint64_t> blockEnds; // end offset of each block written, relative to the first block
+    array<unsigned char, 256> tableLengths; // the last table stored in a block
+    size_t tableBlock = SIZE_MAX; // the block it is stored in
+    uint64_t length = 0; // bytes of text encoded so far
+    uint64_t written = 0; // bytes of blocks written so far
+    bool started = false; // whether the header was written
+
+    /*
+    * @param output Receives the encoded bytes as soon as they are produced.
+    */
+    HuffmanEncoder(function<void(const unsigned char*, size_t)> output): sink(output){}
+
+    /*
+    * @param output The stream the encoded bytes are written to.
+    */
+    HuffmanEncoder(ostream& output): sink([&output](const unsigned char* data, size_t size){
+        output.write((const char*)data, size);
+    }){}
+
+    /*
+    * Adds text to the stream.
+    * Whole blocks are encoded straight from data; only the remainder is copied.
+    * @param data The text.
+    * @param size The number of bytes in data.
+    */
+    void update(const unsigned char* data, size_t size){
+        start();
+        while (size > 0){
+            size_t take = min(size, tree.blockSize - pending.size());
+            if (pending.empty() && take == tree.blockSize){
+                writeBlock(data, take);
+            } else {
+                pending.insert(pending.end(), data, data + take);
+                if (pending.size() == tree.blockSize){
+                    writeBlock(pending.data(), pending.size());
+                    pending.clear();
+                }
+            }
+            data += take;
+            size -= take;
+        }
+    }
+
+    /*
+    * Adds the rest of a stream to the stream, reading streamBlockSize bytes at a time.
+    * @param input The stream to read text from.
+    */
+    void update(istream& input){
+        vector<unsigned char> buffer(tree.streamBlockSize);
+        while (input.read((char*)buffer.data(), buffer.size()) || input.gcount() > 0){
+            update(buffer.data(), input.gcount());
+        }
+    }
+
+    /*
+    * Encodes the last partial block and writes the block index. The encoder can then start a new stream.
+    */
+    void finish(){
+        start();
+        if (!pending.empty()){
+            writeBlock(pending.data(), pending.size());
+            pending.clear();
+        }
+        vector<unsigned char> footer;
+        HuffmanTree::writeFooter(footer, blockEnds, length);
+        sink(footer.data(), footer.size());
+        tree.encodedLength += written + footer.size();
+        blockEnds.clear();
+        length = 0;
+        written = 0;
+        started = false;
+    }
+
+    /*
+    * Writes the header of a new stream, if it has not been written yet.
+    */
+    void start(){
+        if (started) return;
+        started = true;
+        tree.blockSize = min<uint64_t>(max<size_t>(tree.blockSize, 1), UINT32_MAX);
+        tree.lengthLimitCost = 0;
+        pending.reserve(tree.blockSize);
+        tableBlock = SIZE_MAX;
+        vector<unsigned char> header;
+        tree.writeHeader(header, false); // every block has its own table
+        writeInt(header, crc32c(header.data(), header.size()), 4);
+        sink(header.data(), header.size());
+        tree.encodedLength = header.size();
+    }
+
+    /*
+    * Encodes one block and passes it to the sink.
+    * @param data The text of the block.
+    * @param size The number of bytes in data.
+    */
+    void writeBlock(const unsigned char* data, size_t size){
+        length += size;
+        STATS(tree.stats.bytesIn += size);
+        data = tree.transformBlock(data, size, tree.transformed);
+        tree.charCounts.fill(0);
+        tree.addCharFrequencies(data, size);
+        uint64_t cost = tree.lengthLimitCost;
+        tree.buildTree();
+        uint64_t distance = 0;
+        size_t block = blockEnds.size();
+        if (tree.reuseTables && tableBlock < block && HuffmanTree::reuseTable(tree.charCounts, tree.codeLengths, tableLengths)){
+            distance = block - tableBlock;
+            tree.codeLengths = tableLengths;
+            tree.assignCanonicalCodes();
+            tree.lengthLimitCost = cost;
+        } else {
+            tableLengths = tree.codeLengths;
+            tableBlock = block;
+            tree.lengthLimitCost += cost;
+        }
+        tree.writeBlock(data, size, encoded, nullptr, distance);
+        sink(encoded.data(), encoded.size());
+        STATS(tree.stats.bytesOut += encoded.size());
+        written += encoded.size();
+        blockEnds.push_back(written);
+    }
+};
+
+/*
+* Decodes a stream in the format written by HuffmanTree::encode() piece by piece, without seeking: the blocks are
+* read in order through their own sizes, and the block index at the end is only checked against them. Each block's
+* checksum is checked before it is decoded; the stream fails at the first block that does not match.
+* Encoded bytes are buffered until a block is complete, so memory stays within about one encoded and one decoded
+* block beyond the pieces passed to update(). The rest of the state is about 5 KB inline plus one flat decode table
+* of up to 2^11 root entries (8 KB); lowering tree.decodeTable.indexBits shrinks the table for many concurrent decoders.
+*/
+struct HuffmanDecoder{
+    HuffmanTree tree; // per-block state, and the shared table if the stream has one
+    function<void(const unsigned char*, size_t)> sink; // receives the decoded text in order
+    vector<unsigned char> buffer; // encoded bytes not decoded yet
+    vector<unsigned char> text; // the last decoded block
+    BlockIndex layout; // block size and table mode from the header
+    bool started = false; // whether the header was read
+    bool done = false; // whether the end of the blocks was reached
+    bool failed = false; // whether the stream turned out to be corrupt
+    uint64_t length = 0; // bytes of text decoded so far
+    size_t blocks = 0; // blocks decoded so far
+    size_t tableBlock = SIZE_MAX; // the last block that stored a table
+    uint64_t footerBytes = 0; // bytes received after the end of the blocks
+    vector<uint64_t> blockEnds; // end offset of each decoded block relative to the first, to check the index against
+
+    /*
+    * @param output Receives the decoded text as soon as each block is decoded.
+    */
+    HuffmanDecoder(function<void(const unsigned char*, size_t)> output): sink(output){}
+
+    /*
+    * @param output The stream the decoded text is written to.
+    */
+    HuffmanDecoder(ostream& output): sink([&output](const unsigned char* data, size_t size){
+        output.write((const char*)data, size);
+    }){}
+
+    /*
+    * Adds encoded bytes to the stream and decodes every block they complete.
+    * @param data The encoded bytes.
+    * @param size The number of bytes in data.
+    */
+    void update(const unsigned char* data, size_t size){
+        bool ended = done;
+        buffer.insert(buffer.end(), data, data + size);
+        size_t used = 0;
+        if (!started){
+            size_t header = HuffmanTree::measureHeader(buffer.data(), buffer.size());
+            if (!header) return;
+            tree.readHeader(buffer.data(), header, layout);
+            started = true;
+            tableBlock = SIZE_MAX; // a table from an earlier stream is never reused
+            failed = layout.blockSize == 0;
+            done = failed;
+            used = header;
+        }
 
-    CountNode(int c = 0, CountNode* l = nullptr, CountNode* r = nullptr){
-        count = c;
-        left = l;
-        right = r;
+        // a block never needs more room than its table, jump table and longest possible codes
+        uint64_t longestBlock = HuffmanTree::transformedSize(layout.transforms, layout.blockSize);
+        uint64_t largest = 4 + 2 + 256 + 1 + 4 * 255 + BitWriter::capacity(longestBlock * 32) + 8 * 255 + 4;
+        const DecodeTable* shared = layout.shared ? &tree.decodeTable : nullptr;
+        while (!done){
+            uint64_t block = HuffmanTree::measureBlock(buffer.data() + used, buffer.size() - used, layout.shared);
+            if (block > largest){
+                failed = done = true;
+            } else if (block == 4){
+                done = true; // the end of the blocks
+                used += 4;
+            } else if (block && block <= buffer.size() - used){
+                size_t blockLength = readInt(buffer.data() + used, 4);
+                if (blockLength > longestBlock || !HuffmanTree::checksumMatches(buffer.data() + used, block)){
+                    failed = done = true;
+                    break;
+                }
+                // a block may only reuse the last stored table, which is still in decodeTable
+                uint64_t distance = shared ? 0 : HuffmanTree::tableDistance(buffer.data() + used, block);
+                if (distance && (distance > blocks || blocks - distance != tableBlock)){
+                    failed = done = true;
+                    break;
+                }
+                if (!shared && !distance) tableBlock = blocks;
+                if (layout.transforms.empty()){
+                    text.resize(blockLength);
+                    if (!tree.decodeBlock(buffer.data() + used, block, text.data(), blockLength, shared, &tree.decodeTable)){
+                        failed = done = true;
+                        break;
+                    }
+                } else if (tree.untransformBlock(buffer.data() + used, block, layout, shared, &tree.decodeTable)){
+                    text.swap(tree.transformed);
+                } else {
+                    failed = done = true;
+                    break;
+                }
+                sink(text.data(), text.size());
+                STATS(tree.stats.bytesIn += block);
+                STATS(tree.stats.bytesOut += text.size());
+                length += text.size();
+                blockEnds.push_back((blocks ? blockEnds[blocks - 1] : 0) + block);
+                blocks++;
+                used += block;
+            } else {
+                break; // wait for the rest of the block
+            }
+        }
+
+        // past the blocks, the index is compared with the blocks as it arrives and only the last 16 bytes are kept
+        if (done){
+            size_t footerStart = ended ? buffer.size() - size : used;
+            for (size_t i = footerStart; i < buffer.size(); i++){
+                uint64_t position = footerBytes + i - footerStart;
+                if (position < 8 * blocks && buffer[i] != ((blockEnds[position / 8] >> (8 * (position % 8))) & 0xFF)) failed = true;
+            }
+            footerBytes += buffer.size() - footerStart;
+            used = buffer.size() - min<size_t>(16, buffer.size() - used);
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + used);
     }
-    ~CountNode(){ // will recursively delete pointers to remaining nodes
-        delete left;
-        delete right;
+
+    /*
+    * Adds the rest of a stream of encoded bytes, reading streamBlockSize bytes at a time.
+    * @param input The stream to read encoded bytes from.
+    */
+    void update(istream& input){
+        vector<unsigned char> chunk(tree.streamBlockSize);
+        while (input.read((char*)chunk.data(), chunk.size()) || input.gcount() > 0){
+            update(chunk.data(), input.gcount());
+        }
     }
 
     /*
-    * The (pre-order) traversal to encode the tree. Only leaves (HuffmanTreeNodes) are encoded.
-    * @param codeMap The map between a character and its binary (as a string).
-    * @param prefixBits The prefix of bits representing the encoding to this node.
+    * Ends the stream. The decoder can then start a new stream.
+    * @return Whether the stream was complete and its footer matched the decoded blocks.
     */
-    virtual void traverseForCodeMap(unordered_map<char, string>& codeMap, string prefixBits = ""){
-        if (this->left)
-            left->traverseForCodeMap(codeMap, prefixBits+"0");
-        if (this->right)
-            right->traverseForCodeMap(codeMap, prefixBits+"1");
+    bool finish(){
+        vector<unsigned char> footer; // as it should be, from the blocks
+        HuffmanTree::writeFooter(footer, blockEnds, length);
+        bool complete = done && !failed && footerBytes == footer.size() - 4 && buffer.size() == 16
+            && equal(buffer.begin(), buffer.end(), footer.end() - 16);
+        buffer.clear();
+        started = done = failed = false;
+        length = blocks = footerBytes = 0;
+        blockEnds.clear();
+        tableBlock = SIZE_MAX;
+        return complete;
     }
-    
+};
+
+/*
+* Encodes a stream in one pass with an AdaptiveHuffmanTree, so output starts with the first byte of text and memory
+* stays constant. The stream has no header or table; it is the codes of the text, then an escape with endOfStream,
+* padded with zero bits to a whole byte. Every byte completed by update() is passed to the sink before it returns.
+*/
+struct AdaptiveHuffmanEncoder{
+    static constexpr size_t chunkSize = 4096; // bytes of text coded between calls to the sink
+    AdaptiveHuffmanTree tree;
+    function<void(const unsigned char*, size_t)> sink; // receives the encoded bytes in order
+    vector<unsigned char> buffer; // encoded bytes of one chunk
+    BitWriter writer; // keeps the last incomplete byte between chunks
+
+    /*
+    * @param output Receives the encoded bytes as soon as they are complete.
+    */
+    AdaptiveHuffmanEncoder(function<void(const unsigned char*, size_t)> output): sink(output){
+        buffer.resize(BitWriter::capacity(chunkSize * (256 + 9))); // longest path plus an escape per byte
+    }
+
+    /*
+    * @param output The stream the encoded bytes are written to.
+    */
+    AdaptiveHuffmanEncoder(ostream& output): AdaptiveHuffmanEncoder([&output](const unsigned char* data, size_t size){
+        output.write((const char*)data, size);
+    }){}
+
     /*
-    * The struct containing a special function to for initializing priority queues.
+    * Encodes text and passes on every completed byte.
+    * @param data The text.
+    * @param size The number of bytes in data.
     */
-    struct NodeComparison {
-        // The special comparison function for priority_queue
-        bool operator()(CountNode* const& node1, CountNode* const& node2){ 
-            return node1->count > node2->count; // min heap
+    void update(const unsigned char* data, size_t size){
+        for (size_t start = 0; start < size; start += chunkSize){
+            writer.start = writer.output = buffer.data();
+            for (size_t i = start; i < min(size, start + chunkSize); i++){
+                tree.write(data[i], writer);
+            }
+            sink(buffer.data(), writer.output - writer.start);
         }
-    };
+    }
+
+    /*
+    * Encodes the rest of a stream, reading chunkSize bytes at a time.
+    * @param input The stream to read text from.
+    */
+    void update(istream& input){
+        vector<unsigned char> chunk(chunkSize);
+        while (input.read((char*)chunk.data(), chunk.size()) || input.gcount() > 0){
+            update(chunk.data(), input.gcount());
+        }
+    }
+
+    /*
+    * Ends the stream and passes on its last bytes. The encoder can then start a new stream.
+    */
+    void finish(){
+        writer.start = writer.output = buffer.data();
+        tree.writeEscape(AdaptiveHuffmanTree::endOfStream, writer);
+        sink(buffer.data(), (writer.output - writer.start) + (writer.used + 7) / 8);
+        writer = BitWriter();
+        tree.reset();
+    }
 };
-struct HuffmanTreeNode: CountNode{
-    char letter;
 
-    HuffmanTreeNode(char ch, int c = 0, HuffmanTreeNode* l = nullptr, HuffmanTreeNode* r = nullptr): CountNode(c, l, r){
-        letter = ch;
+/*
+* Decodes a stream written by AdaptiveHuffmanEncoder, one bit at a time, walking the same tree the encoder built.
+* Text is passed to the sink at the end of every update(), so it follows the encoded bytes without delay.
+*/
+struct AdaptiveHuffmanDecoder{
+    AdaptiveHuffmanTree tree;
+    function<void(const unsigned char*, size_t)> sink; // receives the decoded text in order
+    vector<unsigned char> text; // text decoded by the current update()
+    int node = AdaptiveHuffmanTree::root; // slot reached by the bits of the current code
+    int escapeBits = 0; // bits of an escaped value read so far, or -1 outside an escape
+    int escapeValue = 0; // the bits of the escaped value read so far
+    bool done = false; // whether the end of the stream was reached
+    bool failed = false; // whether the stream was corrupt; decoding stopped there
+
+    /*
+    * @param output Receives the decoded text as soon as it is decoded.
+    */
+    AdaptiveHuffmanDecoder(function<void(const unsigned char*, size_t)> output): sink(output){}
+
+    /*
+    * @param output The stream the decoded text is written to.
+    */
+    AdaptiveHuffmanDecoder(ostream& output): sink([&output](const unsigned char* data, size_t size){
+        output.write((const char*)data, size);
+    }){}
+
+    /*
+    * Decodes encoded bytes and passes on the text they complete. Bytes after the end of the stream are ignored.
+    * @param data The encoded bytes.
+    * @param size The number of bytes in data.
+    */
+    void update(const unsigned char* data, size_t size){
+        text.clear();
+        for (size_t i = 0; i < size && !done; i++){
+            for (int bit = 7; bit >= 0 && !done; bit--){
+                step((data[i] >> bit) & 1);
+            }
+        }
+        sink(text.data(), text.size());
+    }
+
+    /*
+    * Decodes the rest of a stream of encoded bytes, reading chunkSize bytes at a time.
+    * @param input The stream to read encoded bytes from.
+    */
+    void update(istream& input){
+        vector<unsigned char> chunk(AdaptiveHuffmanEncoder::chunkSize);
+        while (input.read((char*)chunk.data(), chunk.size()) || input.gcount() > 0){
+            update(chunk.data(), input.gcount());
+        }
+    }
+
+    /*
+    * Follows one bit of the stream, completing a byte when it reaches a leaf or finishes an escape.
+    * @param bit The next bit.
+    */
+    void step(int bit){
+        if (escapeBits >= 0){
+            escapeValue = (escapeValue << 1) | bit;
+            if (++escapeBits < 9) return;
+            escapeBits = -1;
+            if (escapeValue == AdaptiveHuffmanTree::endOfStream){
+                done = true;
+                return;
+            }
+            if (escapeValue > 255 || tree.leafOf[escapeValue] >= 0){
+                failed = done = true; // not a byte, or a byte that already has a code
+                return;
+            }
+            symbolDecoded(escapeValue);
+            return;
+        }
+        node = bit ? tree.right[node] : tree.left[node];
+        if (tree.left[node] >= 0) return;
+        if (tree.right[node] == AdaptiveHuffmanTree::nyt){
+            escapeBits = 0;
+            escapeValue = 0;
+        } else {
+            symbolDecoded(tree.right[node]);
+        }
+    }
+
+    /*
+    * Emits a decoded byte, updates the tree for it and returns to the root.
+    * @param symbol The byte value.
+    */
+    void symbolDecoded(int symbol){
+        text.push_back(symbol);
+        tree.update(symbol);
+        node = AdaptiveHuffmanTree::root;
     }
 
     /*
-    * Saves the encoding for HuffmanTreeNodes when visited by a CountNode's invocation of traverseForCodeMap.
-    * @param codeMap The map between a character and its binary (as a string).
-    * @param bits The prefix of bits representing the encoding to this node.
+    * Ends the stream. The decoder can then start a new stream.
+    * @return Whether the end of the stream was reached without the stream being corrupt.
     */
-    void traverseForCodeMap(unordered_map<char, string>& codeMap, string bits = "") override {
-        codeMap[letter] = bits;
+    bool finish(){
+        bool complete = done && !failed;
+        tree.reset();
+        node = AdaptiveHuffmanTree::root;
+        escapeBits = 0;
+        escapeValue = 0;
+        done = false;
+        failed = false;
+        return complete;
     }
 };
-struct HuffmanTree{
-    CountNode* root;
-    priority_queue<CountNode*, vector<CountNode*>, CountNode::NodeComparison> nodeHeap;
-    unordered_map<char, string> codeMap; // char to code
-    unordered_map<string, char> reverseCodeMap; // code to char
 
-    ~HuffmanTree(){
-        delete root;
+/*
+* A non-interactive benchmark of the coders over a corpus. Every input is encoded and decoded repeat times by each
+* engine; the fastest runs are reported with the compression ratio, the bytes spent on headers and tables, and the
+* peak resident memory while the engine ran, as a table or as JSON to track regressions. The peak is reset before each
+* engine through /proc/self/clear_refs; where that is not possible it is the peak of the whole process so far.
+* Usage: huffmantree --bench [--json] [--repeat N] [files...]
+* Without files, the corpus is lorem.txt (if present) plus 1 MB each of generated random and skewed bytes;
+* pass larger files (Silesia, enwik8, ...) to measure real workloads.
+*/
+struct Benchmark{
+    struct Result{
+        string input;
+        string engine;
+        uint64_t bytes = 0; // bytes of text
+        uint64_t encoded = 0; // bytes of encoded output
+        uint64_t header = 0; // bytes of the output that are not codes: headers, tables, jump tables and the index
+        double encodeSeconds = 0; // fastest encode
+        double decodeSeconds = 0; // fastest decode
+        long peakMemory = 0; // peak resident set while the engine ran, in KB, including the input
+        bool ok = false; // whether the decoded text matched
+    };
+    int repeat = 3; // runs of each engine; the fastest is reported
+    vector<Result> results;
+    bool enginePeaks = true; // whether the peak could be reset before each engine; if not, peaks are process-wide
+
+    /*
+    * Runs the benchmark from command-line arguments.
+    * @param argc The number of arguments after --bench.
+    * @param argv The arguments after --bench.
+    * @return The exit status: 0 if every engine decoded every input correctly.
+    */
+    static int run(int argc, char** argv){
+        Benchmark benchmark;
+        bool json = false;
+        vector<string> files;
+        for (int i = 0; i < argc; i++){
+            string argument = argv[i];
+            if (argument == "--json"){
+                json = true;
+            } else if (argument == "--repeat" && i + 1 < argc){
+                benchmark.repeat = max(atoi(argv[++i]), 1);
+            } else {
+                files.push_back(argument);
+            }
+        }
+
+        if (files.empty()){
+            if (ifstream("lorem.txt")) benchmark.measure("lorem.txt", readFile("lorem.txt"));
+            mt19937 random(1);
+            vector<unsigned char> text(1 << 20);
+            for (unsigned char& byte: text){
+                byte = random();
+            }
+            benchmark.measure("random", text);
+            for (unsigned char& byte: text){
+                byte = 0;
+                while (byte < 255 && random() % 4 == 0) byte++; // each value 4 times as likely as the next
+            }
+            benchmark.measure("skewed", text);
+        }
+        for (const string& file: files){
+            benchmark.measure(file, readFile(file));
+        }
+        benchmark.report(cout, json);
+        for (const Result& result: benchmark.results){
+            if (!result.ok) return 1;
+        }
+        return 0;
     }
 
     /*
-    * Counts the frequencies of each character in a file and creates HuffmanTreeNodes for each one. The nodes are stored in nodeHeap.
-    * @param fileName The name of the file from which text is read.
-    */ 
-    void countCharFrequencies(string fileName){
-        ifstream input(fileName);
-        unordered_map<char, int> charCounts;
-        char ch;
+    * Runs every engine over one input and records the results.
+    * @param input The name of the input.
+    * @param text The input.
+    */
+    void measure(const string& input, const vector<unsigned char>& text){
+        // the file API reads and writes files, so it works on a temporary copy of the input
+        const char* directory = getenv("TMPDIR");
+        string path = string(directory ? directory : "/tmp") + "/huffmantree_bench_" + to_string(getpid());
+        writeFile(path + ".bin", text);
+        measure(input, "file", text, [&](vector<unsigned char>& encoded){
+            HuffmanTree tree;
+            tree.encode(path + ".bin");
+            encoded = readFile(path + "_encoded.txt");
+        }, [&](const vector<unsigned char>&, vector<unsigned char>& decoded){
+            HuffmanTree tree;
+            tree.decode(path + "_encoded.txt");
+            decoded = readFile(path + "_encoded_decoded.txt");
+        }, blockMetadata);
+        remove((path + ".bin").c_str());
+        remove((path + "_encoded.txt").c_str());
+        remove((path + "_encoded_decoded.txt").c_str());
+
+        for (bool transforms: {false, true}){
+            measure(input, transforms ? "stream+bwt" : "stream", text, [&](vector<unsigned char>& encoded){
+                encoded.clear();
+                HuffmanEncoder encoder([&](const unsigned char* data, size_t size){
+                    encoded.insert(encoded.end(), data, data + size);
+                });
+                if (transforms){
+                    encoder.tree.transforms = {Transform::find(Transform::burrowsWheeler), Transform::find(Transform::moveToFront),
+                        Transform::find(Transform::runLength)};
+                }
+                encoder.update(text.data(), text.size());
+                encoder.finish();
+            }, [&](const vector<unsigned char>& encoded, vector<unsigned char>& decoded){
+                decoded.clear();
+                HuffmanDecoder decoder([&](const unsigned char* data, size_t size){
+                    decoded.insert(decoded.end(), data, data + size);
+                });
+                decoder.update(encoded.data(), encoded.size());
+                if (!decoder.finish()) decoded.clear();
+            }, blockMetadata);
+        }
+
+        // the same format, decoded in memory straight into a buffer of the size from the footer
+        measure(input, "memory", text, [&](vector<unsigned char>& encoded){
+            encoded.clear();
+            HuffmanEncoder encoder([&](const unsigned char* data, size_t size){
+                encoded.insert(encoded.end(), data, data + size);
+            });
+            encoder.update(text.data(), text.size());
+            encoder.finish();
+        }, [&](const vector<unsigned char>& encoded, vector<unsigned char>& decoded){
+            HuffmanTree tree;
+            decoded.resize(tree.decodedSize(encoded.data(), encoded.size()));
+            if (!tree.decode(encoded.data(), encoded.size(), decoded.data(), decoded.size())) decoded.clear();
+        }, blockMetadata);
+
+        measure(input, "adaptive", text, [&](vector<unsigned char>& encoded){
+            encoded.clear();
+            AdaptiveHuffmanEncoder encoder([&](const unsigned char* data, size_t size){
+                encoded.insert(encoded.end(), data, data + size);
+            });
+            encoder.update(text.data(), text.size());
+            encoder.finish();
+        }, [&](const vector<unsigned char>& encoded, vector<unsigned char>& decoded){
+            decoded.clear();
+            AdaptiveHuffmanDecoder decoder([&](const unsigned char* data, size_t size){
+                decoded.insert(decoded.end(), data, data + size);
+            });
+            decoder.update(encoded.data(), encoded.size());
+            if (!decoder.finish()) decoded.clear();
+        }, [](const vector<unsigned char>&){
+            return uint64_t(0); // no header; new bytes are escaped inline
+        });
+
+        measure(input, "symbol", text, [&](vector<unsigned char>& encoded){
+            SymbolCoder<uint8_t> coder;
+            coder.encode(text.data(), text.size(), encoded);
+        }, [&](const vector<unsigned char>& encoded, vector<unsigned char>& decoded){
+            SymbolCoder<uint8_t> coder;
+            if (!coder.decode(encoded.data(), encoded.size(), decoded)) decoded.clear();
+        }, [](const vector<unsigned char>& encoded){
+            return encoded.size() < 4 ? 0 : 4 + 2 * readInt(encoded.data(), 4) + 8;
+        });
+
+        // order-1 codes: slower, as every lookup waits for the byte before it, but smaller on text
+        measure(input, "context", text, [&](vector<unsigned char>& encoded){
+            ContextCoder coder;
+            coder.encode(text.data(), text.size(), encoded);
+        }, [&](const vector<unsigned char>& encoded, vector<unsigned char>& decoded){
+            ContextCoder coder;
+            if (!coder.decode(encoded.data(), encoded.size(), decoded)) decoded.clear();
+        }, [](const vector<unsigned char>& encoded){
+            return encoded.empty() ? 0 : 1 + (encoded[0] > 1 ? 128 : 0) + 128 * encoded[0] + 8;
+        });
+    }
+
+    /*
+    * Times one engine over one input and records the result.
+    * @param input The name of the input.
+    * @param engine The name of the engine.
+    * @param text The input.
+    * @param encode Encodes text into its argument.
+    * @param decode Decodes its first argument into its second.
+    * @param header Counts the bytes of an encoded output that are not codes.
+    */
+    void measure(const string& input, const string& engine, const vector<unsigned char>& text,
+        function<void(vector<unsigned char>&)> encode, function<void(const vector<unsigned char>&, vector<unsigned char>&)> decode,
+        function<uint64_t(const vector<unsigned char>&)> header){
+        Result result;
+        result.input = input;
+        result.engine = engine;
+        result.bytes = text.size();
+        vector<unsigned char> encoded;
+        vector<unsigned char> decoded;
+        enginePeaks = resetPeakMemory() && enginePeaks;
+        result.encodeSeconds = fastest([&](){ encode(encoded); });
+        result.decodeSeconds = fastest([&](){ decode(encoded, decoded); });
+        result.encoded = encoded.size();
+        result.header = header(encoded);
+        result.ok = decoded == text;
+        result.peakMemory = peakMemory();
+        results.push_back(result);
+    }
+
+    /*
+    * Lowers the peak resident set of the process to its current size, so that the next peak belongs to what runs next.
+    * @return Whether the kernel reset it; it cannot outside Linux.
+    */
+    static bool resetPeakMemory(){
+        ofstream clearRefs("/proc/self/clear_refs");
+        clearRefs << "5" << flush;
+        return clearRefs.good();
+    }
+
+    /*
+    * @return The peak resident set of the process since the last resetPeakMemory(), or since it started, in KB.
+    */
+    static long peakMemory(){
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line)){
+            if (line.compare(0, 6, "VmHWM:") == 0) return atol(line.c_str() + 6);
+        }
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    /*
+    * @param work The work to time.
+    * @return The fastest of repeat runs, in seconds.
+    */
+    double fastest(function<void()> work){
+        double best = numeric_limits<double>::max();
+        for (int i = 0; i < repeat; i++){
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            work();
+            best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+
+    /*
+    * Counts the bytes of a file in the format of HuffmanTree::encode() that are not codes.
+    * @param encoded The encoded file.
+    * @return Its size less the bytes of every stream.
+    */
+    static uint64_t blockMetadata(const vector<unsigned char>& encoded){
+        HuffmanTree tree;
+        BlockIndex blocks;
+        tree.readBlockIndex(encoded.data(), encoded.size(), blocks);
+        uint64_t codes = 0;
+        for (size_t block = 0; block < blocks.blockCount(); block++){
+            const unsigned char* data = encoded.data() + blocks.blockStart(block);
+            size_t size = blocks.ends[block] - blocks.blockStart(block);
+            size_t used = 4;
+            if (!blocks.shared){
+                used = 8;
+                if (HuffmanTree::tableDistance(data, size) == 0) used += HuffmanTree::codeLengthsSize(data + used, size - used);
+            }
+            int streamCount = used < size ? data[used++] : 0;
+            for (int stream = 0; stream < streamCount && used + 4 * stream + 4 <= size; stream++){
+                codes += readInt(data + used + 4 * stream, 4);
+            }
+        }
+        return encoded.size() - codes;
+    }
 
-        while (input.get(ch)){
-            if (charCounts.find(ch) != charCounts.end()){
-                charCounts[ch] += 1;
+    /*
+    * Prints the results.
+    * @param output The stream to print to.
+    * @param json Whether to print a JSON array of one object per result instead of a table.
+    */
+    void report(ostream& output, bool json){
+        output << fixed;
+        if (json) output << "[" << endl;
+        else output << left << setw(16) << "input" << setw(12) << "engine" << right << setw(12) << "bytes" << setw(12) << "encoded"
+            << setw(8) << "ratio" << setw(10) << "header" << setw(10) << "enc MB/s" << setw(10) << "dec MB/s" << setw(10) << "peak KB" << "  ok" << endl;
+        for (size_t i = 0; i < results.size(); i++){
+            const Result& result = results[i];
+            double ratio = result.bytes ? double(result.encoded) / result.bytes : 0;
+            double encodeSpeed = result.bytes / max(result.encodeSeconds, 1e-9) / 1e6;
+            double decodeSpeed = result.bytes / max(result.decodeSeconds, 1e-9) / 1e6;
+            if (json){
+                output << "  {\"input\": " << jsonString(result.input) << ", \"engine\": " << jsonString(result.engine)
+                    << ", \"bytes\": " << result.bytes << ", \"encoded\": " << result.encoded << ", \"headerBytes\": " << result.header
+                    << setprecision(4) << ", \"ratio\": " << ratio << setprecision(2) << ", \"encodeMBps\": " << encodeSpeed
+                    << ", \"decodeMBps\": " << decodeSpeed << ", \"peakRssKB\": " << result.peakMemory
+                    << ", \"peakPerEngine\": " << (enginePeaks ? "true" : "false")
+                    << ", \"ok\": " << (result.ok ? "true" : "false") << "}" << (i + 1 < results.size() ? "," : "") << endl;
             } else {
-                charCounts[ch] = 1;
+                output << left << setw(16) << result.input << setw(12) << result.engine << right << setw(12) << result.bytes
+                    << setw(12) << result.encoded << setprecision(3) << setw(8) << ratio << setw(10) << result.header << setprecision(1)
+                    << setw(10) << encodeSpeed << setw(10) << decodeSpeed << setw(10) << result.peakMemory << (result.ok ? "  yes" : "  NO") << endl;
             }
         }
-        input.close();
-        if (charCounts.empty()) return; // no text entered
-        // cout << "total entries: " << charCounts.size() << endl;
+        if (json) output << "]" << endl;
+        else if (!enginePeaks) output << "peak KB is the peak resident set of the whole process so far, not of one engine." << endl;
+    }
 
-        // set up min-heap to build tree leafs-up
-        for (const pair<char, int> p: charCounts){
-            // cout << p.first << ": " << p.second << endl;
-            HuffmanTreeNode* node = new HuffmanTreeNode(p.first, p.second);
-            nodeHeap.push(node);
+    /*
+    * @param text Any text.
+    * @return The text as a quoted JSON string.
+    */
+    static string jsonString(const string& text){
+        ostringstream quoted;
+        quoted << '"';
+        for (unsigned char c: text){
+            if (c == '"' || c == '\\') quoted << '\\' << c;
+            else if (c < 0x20) quoted << "\\u" << hex << setw(4) << setfill('0') << int(c) << dec << setfill(' ');
+            else quoted << c;
         }
+        quoted << '"';
+        return quoted.str();
     }
 
     /*
-    * Builds a huffman coding tree by depleting nodeHeap and updates root.
-    * Precondition: countCharFrequencies() has been called, and the ifstream has at least one character.
+    * @param fileName The name of a file.
+    * @return Its contents; empty if it cannot be read.
     */
-    void buildTree(){
-        if (nodeHeap.empty()) return;
- 
-        // first letter node (child on right)
-        if (root) delete root;
-        codeMap.clear();
-        root = new CountNode();
-        root->right = nodeHeap.top();
-        nodeHeap.pop();
-        root->count = root->right->count;
-        
-        // second letter node (next greatest; child on left)
-        if (!nodeHeap.empty()){
-            root->left = nodeHeap.top();
-            nodeHeap.pop();
-            root->count += root->left->count;
-        }
-        nodeHeap.push(root);
-
-        // add remaining nodes
-        while (nodeHeap.size() > 1){
-            CountNode* next = new CountNode();
-            next->right = nodeHeap.top();
-            nodeHeap.pop();
-            next->left = nodeHeap.top();
-            nodeHeap.pop();
-            next->count = next->right->count + next->left->count;
-
-            nodeHeap.push(next);
-            // cout << next->letter << endl;
-        }
-
-        // update root node
-        root = nodeHeap.top();
-        nodeHeap.pop();
-        
-        // store the binary of each character in the tree
-        // codeMap is edited in-place
-        root->traverseForCodeMap(codeMap);
-    }
-
-    /*
-    * Export the Huffman coding tree and encoded text to a file.
-    * Exports in the format "[char][code]\n"..."[char][code]\n\n[encodedText]"
-    * @param fileName The name of the file to be encoded.
+    static vector<unsigned char> readFile(const string& fileName){
+        ifstream input(fileName, ios::binary);
+        return vector<unsigned char>(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+    }
+
+    /*
+    * @param fileName The name of a file to create or replace.
+    * @param data Its contents.
     */
-    virtual void encode(string fileName){
-        ifstream input(fileName);
-        int index = 0;
-        while (fileName.find('.', index+1) != -1){
-            index = fileName.find('.', index+1);
+    static void writeFile(const string& fileName, const vector<unsigned char>& data){
+        ofstream output(fileName, ios::binary);
+        output.write((const char*)data.data(), data.size());
+    }
+};
+
+/*
+* Round-trip and corruption checks of the encoded file format and the coders, to catch regressions in the format and
+* in how damage is reported. Each check prints its name and "ok" or "FAILED". Files are written to TMPDIR (or /tmp).
+* Usage: huffmantree --selftest
+*/
+struct SelfTest{
+    string path; // prefix of the temporary files
+    int failures = 0;
+
+    /*
+    * Runs every check.
+    * @return The exit status: 0 if every check passed, 1 otherwise.
+    */
+    static int run(){
+        SelfTest test;
+        const char* directory = getenv("TMPDIR");
+        test.path = string(directory ? directory : "/tmp") + "/huffmantree_selftest_" + to_string(getpid());
+        test.container();
+        test.callerBuffers();
+        test.symbols();
+        test.contexts();
+        test.staticTables();
+        test.adaptive();
+        test.specializedDecoders();
+        remove((test.path + ".bin").c_str());
+        remove((test.path + "_encoded.txt").c_str());
+        remove((test.path + "_encoded_decoded.txt").c_str());
+        cout << (test.failures ? to_string(test.failures) + " checks FAILED" : "all checks ok") << endl;
+        return test.failures ? 1 : 0;
+    }
+
+    /*
+    * Records and prints the outcome of one check.
+    * @param name What was checked.
+    * @param passed Whether it held.
+    */
+    void check(const string& name, bool passed){
+        cout << left << setw(60) << name << (passed ? "ok" : "FAILED") << endl;
+        failures += !passed;
+    }
+
+    /*
+    * @param size The number of bytes.
+    * @param seed Seeds the generator.
+    * @return Skewed random bytes, so that the codes have a range of lengths.
+    */
+    static vector<unsigned char> sampleText(size_t size, unsigned seed){
+        mt19937 random(seed);
+        vector<unsigned char> text(size);
+        for (unsigned char& byte: text){
+            byte = 'a';
+            while (byte < 'z' && random() % 3 == 0) byte++;
+        }
+        return text;
+    }
+
+    /*
+    * Encodes a file with the file API and decodes it with every decoder of the format.
+    * @param text The text to encode; it is written to path + ".bin".
+    * @param tree The options to encode with.
+    * @return The encoded file.
+    */
+    vector<unsigned char> encodeFile(const vector<unsigned char>& text, HuffmanTree& tree){
+        Benchmark::writeFile(path + ".bin", text);
+        tree.encode(path + ".bin");
+        return Benchmark::readFile(path + "_encoded.txt");
+    }
+
+    /*
+    * Decodes an encoded file held in memory with HuffmanDecoder.
+    * @param encoded The encoded file.
+    * @param text Receives the text.
+    * @return Whether finish() reported the stream intact.
+    */
+    static bool decodeStream(const vector<unsigned char>& encoded, vector<unsigned char>& text){
+        text.clear();
+        HuffmanDecoder decoder([&text](const unsigned char* data, size_t size){
+            text.insert(text.end(), data, data + size);
+        });
+        decoder.update(encoded.data(), encoded.size());
+        return decoder.finish();
+    }
+
+    /*
+    * Points a block of an encoded file at the table of another block, and rewrites its checksum to match.
+    * @param encoded The encoded file.
+    * @param blocks The layout of the file.
+    * @param block The number of the block to change.
+    * @param distance How many blocks back the table it reuses is.
+    */
+    static void redirectTable(vector<unsigned char>& encoded, const BlockIndex& blocks, size_t block, uint64_t distance){
+        unsigned char* data = encoded.data() + blocks.blockStart(block);
+        size_t size = blocks.ends[block] - blocks.blockStart(block);
+        for (int i = 0; i < 4; i++){
+            data[4 + i] = distance >> (8 * i);
         }
-        ofstream output(fileName.substr(0, index) + "_encoded.txt");
+        uint32_t crc = crc32c(data, size - 4);
+        for (int i = 0; i < 4; i++){
+            data[size - 4 + i] = crc >> (8 * i);
+        }
+    }
 
-        countCharFrequencies(fileName);
-        buildTree(); 
+    /*
+    * The checksummed container: verify(), decode(), decodeRange() and HuffmanDecoder on intact files, a block with a
+    * flipped byte, a damaged header and a truncated footer, and every single-bit flip of a small file.
+    */
+    void container(){
+        vector<unsigned char> text = sampleText(50000, 1);
+        HuffmanTree encoder;
+        encoder.blockSize = 4096;
+        encoder.threads = 4;
+        vector<unsigned char> encoded = encodeFile(text, encoder);
+        string name = path + "_encoded.txt";
+        vector<unsigned char> decoded;
+
+        HuffmanTree tree;
+        check("container: verify() accepts an intact file", tree.verify(name) && tree.corruptBlocks == 0);
+        check("container: decode() restores the text", tree.decode(name) && Benchmark::readFile(path + "_encoded_decoded.txt") == text);
+        check("container: HuffmanDecoder restores the text", decodeStream(encoded, decoded) && decoded == text);
+        vector<unsigned char> range = tree.decodeRange(name, 4000, 9000);
+        check("container: decodeRange() across blocks", equal(range.begin(), range.end(), text.begin() + 4000) && range.size() == 9000);
+        range = tree.decodeRange(name, 49990, 100);
+        check("container: decodeRange() is cut short at the end", range.size() == 10 && equal(range.begin(), range.end(), text.begin() + 49990));
+
+        // one flipped byte inside the first block
+        vector<unsigned char> damaged = encoded;
+        damaged[HuffmanTree::measureHeader(damaged.data(), damaged.size()) + 40] ^= 0x10;
+        Benchmark::writeFile(name, damaged);
+        check("corrupt block: verify() counts one bad block", !tree.verify(name) && tree.corruptBlocks == 1);
+        bool intact = tree.decode(name);
+        decoded = Benchmark::readFile(path + "_encoded_decoded.txt");
+        check("corrupt block: decode() fails and zeros only that block", !intact && tree.corruptBlocks == 1 && decoded.size() == text.size()
+            && all_of(decoded.begin(), decoded.begin() + 4096, [](unsigned char byte){ return byte == 0; })
+            && equal(decoded.begin() + 4096, decoded.end(), text.begin() + 4096));
+        range = tree.decodeRange(name, 8192, 1000);
+        check("corrupt block: decodeRange() elsewhere is intact", tree.corruptBlocks == 0 && equal(range.begin(), range.end(), text.begin() + 8192));
+        tree.decodeRange(name, 100, 1000);
+        check("corrupt block: decodeRange() over it counts it", tree.corruptBlocks == 1);
+        check("corrupt block: HuffmanDecoder fails", !decodeStream(damaged, decoded));
 
-        // export character encodings (codeMap)
-        for (pair<char, string> p: codeMap){
-            output << p.first << p.second << endl;
+        damaged = encoded;
+        damaged[5] ^= 1; // the block size in the header
+        Benchmark::writeFile(name, damaged);
+        check("corrupt header: verify() and decode() fail", !tree.verify(name) && !tree.decode(name));
+
+        damaged.assign(encoded.begin(), encoded.end() - 5);
+        Benchmark::writeFile(name, damaged);
+        check("truncated footer: verify() and decode() fail", !tree.verify(name) && !tree.decode(name));
+        check("truncated footer: HuffmanDecoder fails", !decodeStream(damaged, decoded));
+
+        // block 4 reuses the table of block 2, which reuses one itself; a range read from block 3 has not read block 2
+        BlockIndex blocks;
+        tree.readBlockIndex(encoded.data(), encoded.size(), blocks);
+        bool reusing = true;
+        for (size_t block = 2; block <= 4; block++){
+            reusing = reusing && HuffmanTree::tableDistance(encoded.data() + blocks.blockStart(block), 8) != 0;
         }
-        output << endl;
+        damaged = encoded;
+        redirectTable(damaged, blocks, 4, 2);
+        Benchmark::writeFile(name, damaged);
+        check("chained table: verify() counts the block", reusing && !tree.verify(name) && tree.corruptBlocks == 1);
+        check("chained table: decode() fails", !tree.decode(name) && tree.corruptBlocks == 1);
+        tree.decodeRange(name, 3 * 4096, 4096 + 100);
+        check("chained table: decodeRange() from the block before fails", tree.corruptBlocks == 1);
+        tree.useMemoryMap = true;
+        tree.decodeRange(name, 3 * 4096, 4096 + 100);
+        tree.useMemoryMap = false;
+        check("chained table: mapped decodeRange() fails", tree.corruptBlocks == 1);
+        check("chained table: HuffmanDecoder fails", !decodeStream(damaged, decoded));
 
-        // export encoded file
-        char ch;
-        while (input.get(ch)){
-            output << codeMap[ch];
+        // a flipped byte in block 1 also fails the blocks that reuse its table
+        uint64_t lost = 1;
+        for (size_t block = 2; block < blocks.blockCount(); block++){
+            lost += HuffmanTree::tableDistance(encoded.data() + blocks.blockStart(block), 8) == block - 1;
         }
+        damaged = encoded;
+        damaged[blocks.blockStart(1) + 40] ^= 0x10;
+        Benchmark::writeFile(name, damaged);
+        check("corrupt table: verify() counts the blocks that reuse it", lost > 1 && !tree.verify(name) && tree.corruptBlocks == lost);
+        check("corrupt table: decode() counts them", !tree.decode(name) && tree.corruptBlocks == lost);
+        tree.decodeRange(name, 3 * 4096, 4096);
+        check("corrupt table: decodeRange() after it counts them", tree.corruptBlocks == 1);
 
-        input.close();
-        output.close();
+        // every bit of a small file matters
+        vector<unsigned char> small = sampleText(3000, 2);
+        encoder.blockSize = 1000;
+        encoded = encodeFile(small, encoder);
+        size_t accepted = 0;
+        for (size_t bit = 0; bit < 8 * encoded.size(); bit++){
+            damaged = encoded;
+            damaged[bit / 8] ^= 1 << (bit % 8);
+            accepted += decodeStream(damaged, decoded);
+        }
+        check("bit flips: HuffmanDecoder rejects every flipped bit", accepted == 0);
     }
 
     /*
-    * Import a Huffman coding tree from a file.
-    * The file should be in the format of "[char][code]\n"..."[char][code]\n\n".
-    * @param input The file stream containing tree mappings followed by an empty line.
+    * Decoding into the caller's memory: decodedSize(), one buffer, iovec lists whose pieces straddle blocks, buffers
+    * that are too small, and damaged files.
     */
-    void reconstructTree(istream& input){
-        if (root) delete root;
-        codeMap.clear();
-        reverseCodeMap.clear();
-        CountNode* root = new CountNode();
+    void callerBuffers(){
+        vector<unsigned char> text = sampleText(50000, 3);
+        HuffmanTree encoder;
+        encoder.blockSize = 4096;
+        encoder.threads = 4;
+        vector<unsigned char> encoded = encodeFile(text, encoder);
+        string name = path + "_encoded.txt";
 
-        // rebuild the tree
-        string line;
-        char ch;
-        string s_binary;
-        int binary;
-        while (getline(input, line)){
-            if (line.empty()) break;
-
-            ch = line[0];
-            s_binary = line.substr(1);
-            codeMap[ch] = s_binary;
-            reverseCodeMap[s_binary] = ch;
-            binary = stoi(s_binary);
-
-            CountNode* current = root;
-            int length = s_binary.length();
-            while (length-- > 1){
-                if ((binary & 1) == 1){
-                    if (!current->right) 
-                        current->right = new CountNode();
-                    current = current->right;
-                } else {
-                    if (!current->left) 
-                        current->left = new CountNode();
-                    current = current->left;
-                }
-                binary >>= 1;
+        HuffmanTree tree;
+        check("buffers: decodedSize() from memory and from a file",
+            tree.decodedSize(encoded.data(), encoded.size()) == text.size() && tree.decodedSize(name) == text.size());
+        vector<unsigned char> output(text.size());
+        check("buffers: decode() into one buffer", tree.decode(encoded.data(), encoded.size(), output.data(), output.size()) && output == text);
+        output.assign(text.size() - 1, 0xAA);
+        check("buffers: a buffer too small is left untouched", !tree.decode(encoded.data(), encoded.size(), output.data(), output.size())
+            && all_of(output.begin(), output.end(), [](unsigned char byte){ return byte == 0xAA; }));
+
+        // pieces that start and end inside blocks, one empty, one spanning several blocks
+        output.assign(text.size(), 0);
+        size_t pieces[] = {1, 4095, 3, 0, 9000, 7, 4096};
+        vector<iovec> buffers;
+        size_t used = 0;
+        for (size_t piece: pieces){
+            buffers.push_back({output.data() + used, piece});
+            used += piece;
+        }
+        buffers.push_back({output.data() + used, text.size() - used});
+        check("buffers: decode() into an iovec list", tree.decode(encoded.data(), encoded.size(), buffers.data(), buffers.size()) && output == text);
+        output.assign(text.size(), 0);
+        check("buffers: decode() of a file into an iovec list", tree.decode(name, buffers.data(), buffers.size()) && output == text);
+        buffers.pop_back();
+        check("buffers: an iovec list too small is refused", !tree.decode(encoded.data(), encoded.size(), buffers.data(), buffers.size()));
+
+        // the flipped byte is in block 0, and the blocks that reuse its table fail with it
+        BlockIndex blocks;
+        tree.readBlockIndex(encoded.data(), encoded.size(), blocks);
+        uint64_t lost = 1;
+        for (size_t block = 1; block < blocks.blockCount(); block++){
+            lost += HuffmanTree::tableDistance(encoded.data() + blocks.blockStart(block), 8) == block;
+        }
+        vector<unsigned char> damaged = encoded;
+        damaged[HuffmanTree::measureHeader(damaged.data(), damaged.size()) + 40] ^= 0x10;
+        output.assign(text.size(), 0);
+        check("buffers: a flipped byte fails decode()", !tree.decode(damaged.data(), damaged.size(), output.data(), output.size())
+            && tree.corruptBlocks == lost);
+        damaged.assign(encoded.begin(), encoded.end() - 5);
+        check("buffers: a truncated footer has no decodedSize()", tree.decodedSize(damaged.data(), damaged.size()) == 0
+            && !tree.decode(damaged.data(), damaged.size(), output.data(), output.size()));
+    }
+
+    /*
+    * SymbolCoder for 8-, 16- and 32-bit symbols: round trips, codes long enough for the DecodeTree, and truncated messages.
+    */
+    void symbols(){
+        symbols<uint8_t>("8-bit", 255);
+        symbols<uint16_t>("16-bit", 65535);
+        symbols<uint32_t>("32-bit", UINT32_MAX);
+
+        // counts growing like the Fibonacci numbers give 25-bit codes, which decode through the DecodeTree
+        vector<uint32_t> text;
+        uint64_t previous = 1, count = 1;
+        for (uint32_t symbol = 0; symbol < 26; symbol++){
+            text.insert(text.end(), count, symbol * 100003);
+            count += previous;
+            previous = count - previous;
+        }
+        shuffle(text.begin(), text.end(), mt19937(4));
+        SymbolCoder<uint32_t> coder;
+        vector<unsigned char> encoded;
+        coder.encode(text.data(), text.size(), encoded);
+        vector<uint32_t> decoded;
+        SymbolCoder<uint32_t> decoder;
+        check("symbols: long codes through the DecodeTree", decoder.decode(encoded.data(), encoded.size(), decoded)
+            && decoder.treeDecoding && decoded == text);
+    }
+
+    /*
+    * Round-trips one symbol width.
+    * @param name The width, for the check names.
+    * @param largest The largest symbol to use.
+    */
+    template <typename Symbol>
+    void symbols(const string& name, Symbol largest){
+        mt19937 random(5);
+        vector<Symbol> text(100000);
+        for (Symbol& symbol: text){
+            uint64_t rank = uint64_t(random() % 1000) * (random() % 1000) / 333; // small ranks are the most likely
+            symbol = Symbol(rank * 2654435761u % (uint64_t(largest) + 1)); // spread over the whole range
+        }
+        for (const vector<Symbol>& sample: {vector<Symbol>(), vector<Symbol>(7, largest), text}){
+            SymbolCoder<Symbol> coder;
+            vector<unsigned char> encoded;
+            coder.encode(sample.data(), sample.size(), encoded);
+            vector<Symbol> decoded;
+            SymbolCoder<Symbol> decoder;
+            check("symbols: " + name + " round trip of " + to_string(sample.size()) + " symbols",
+                decoder.decode(encoded.data(), encoded.size(), decoded) && decoded == sample);
+            if (sample.size() < 1000) continue;
+            bool accepted = false;
+            for (size_t size: {size_t(0), size_t(3), encoded.size() / 100, encoded.size() / 2}){
+                accepted |= decoder.decode(encoded.data(), size, decoded);
             }
-            if ((binary & 1) == 1){
-                current->right = new HuffmanTreeNode(ch);
-            } else {
-                current->left = new HuffmanTreeNode(ch);
+            check("symbols: " + name + " truncated messages are rejected", !accepted);
+        }
+    }
+
+    /*
+    * ContextCoder: round trips, and messages cut short in their tables or their codes.
+    */
+    void contexts(){
+        vector<unsigned char> text = sampleText(100000, 8);
+        for (size_t i = 1; i < text.size(); i += 2){
+            text[i] = text[i - 1] ^ 0x20; // every other byte depends on the one before
+        }
+        for (const vector<unsigned char>& sample: {vector<unsigned char>(), vector<unsigned char>(1, 'q'), text}){
+            ContextCoder coder;
+            vector<unsigned char> encoded;
+            coder.encode(sample.data(), sample.size(), encoded);
+            vector<unsigned char> decoded;
+            ContextCoder decoder;
+            check("contexts: round trip of " + to_string(sample.size()) + " bytes",
+                decoder.decode(encoded.data(), encoded.size(), decoded) && decoded == sample);
+            if (sample.size() < 1000) continue;
+            bool accepted = false;
+            // the codes are padded to whole words, so 8 bytes less always cuts into them
+            for (size_t size: {size_t(0), size_t(100), encoded.size() / 2, encoded.size() - 8}){
+                accepted |= decoder.decode(encoded.data(), size, decoded);
             }
+            check("contexts: truncated messages are rejected", !accepted);
         }
     }
+
     /*
-    * Import a Huffman coding tree given tree mappings and encoded text. Then, decode and export the text.
-    * @param fileName The name of the file stream containing tree mappings ("[char][code]\n"..."[char][code]\n\n") and the binary encoding to be decoded.
+    * StaticTable: a trained table loaded from memory, short messages, a message for another table, and truncated ones.
     */
-    void decode(string fileName){
-        ifstream input(fileName); 
-        int index = 0;
-        while (fileName.find('.', index+1) != -1){
-            index = fileName.find('.', index+1);
+    void staticTables(){
+        vector<unsigned char> sample = sampleText(20000, 9);
+        HuffmanTree trainer;
+        trainer.addCharFrequencies(sample.data(), sample.size());
+        vector<unsigned char> serialized;
+        trainer.writeStaticTable(42, serialized);
+        StaticTable table;
+        check("static table: loads from memory", table.load(serialized.data(), serialized.size()) && table.id == 42);
+
+        bool passed = true, accepted = false;
+        vector<unsigned char> encoded, decoded;
+        for (size_t size: {size_t(0), size_t(1), size_t(17), size_t(500)}){
+            vector<unsigned char> message = sampleText(size, 10 + size);
+            message.push_back(0xFF); // a byte value the sample never had
+            table.encode(message.data(), message.size(), encoded);
+            passed = table.decode(encoded.data(), encoded.size(), decoded) && decoded == message && passed;
+            accepted |= table.decode(encoded.data(), encoded.size() - 1, decoded);
         }
-        ofstream output(fileName.substr(0, index) + "_decoded.txt");
+        check("static table: round trips of short messages", passed);
+        check("static table: truncated messages are rejected", !accepted);
+        encoded[0] ^= 1;
+        check("static table: a message for another table is rejected", !table.decode(encoded.data(), encoded.size(), decoded));
+    }
 
-        // reconstruct tree and codeMap
-        reconstructTree(input);
+    /*
+    * AdaptiveHuffmanEncoder and AdaptiveHuffmanDecoder: several streams through one encoder and one decoder, fed in
+    * uneven pieces, with a truncated stream between them.
+    */
+    void adaptive(){
+        vector<vector<unsigned char>> texts = {sampleText(20000, 6), {}, vector<unsigned char>(300, 'x'), sampleText(5000, 7)};
+        vector<unsigned char> encoded;
+        AdaptiveHuffmanEncoder encoder([&encoded](const unsigned char* data, size_t size){
+            encoded.insert(encoded.end(), data, data + size);
+        });
+        vector<vector<unsigned char>> streams;
+        for (const vector<unsigned char>& text: texts){
+            encoded.clear();
+            encoder.update(text.data(), text.size());
+            encoder.finish();
+            streams.push_back(encoded);
+        }
 
-        // decode binary
-        string binary = "";
-        char ch;
-        while (input >> ch){
-            binary += ch;
-            if (reverseCodeMap.find(binary) != reverseCodeMap.end()){
-                output << reverseCodeMap[binary];
-                binary = "";
+        vector<unsigned char> decoded;
+        AdaptiveHuffmanDecoder decoder([&decoded](const unsigned char* data, size_t size){
+            decoded.insert(decoded.end(), data, data + size);
+        });
+        bool passed = true;
+        for (size_t i = 0; i < texts.size(); i++){
+            decoded.clear();
+            for (size_t start = 0; start < streams[i].size(); start += 777){
+                decoder.update(streams[i].data() + start, min<size_t>(777, streams[i].size() - start));
             }
+            passed = decoder.finish() && decoded == texts[i] && passed;
         }
+        check("adaptive: one encoder and decoder for several streams", passed);
 
-        input.close();
-        output.close();
+        decoder.update(streams[0].data(), streams[0].size() / 2);
+        bool truncated = decoder.finish();
+        decoded.clear();
+        decoder.update(streams[3].data(), streams[3].size());
+        check("adaptive: a truncated stream fails, the next one decodes", !truncated && decoder.finish() && decoded == texts[3]);
+    }
+
+    /*
+    * Every instantiation of HuffmanTree::decodeStreams<Streams, MaxLength> and encodeBytes<Group>: texts whose longest
+    * code falls at both ends of each DecodeTable::lengthClasses bound, in 1 to 8 streams.
+    */
+    void specializedDecoders(){
+        for (int maxLength: {5, 8, 9, 11, 12, 14, 15, 18, 19, 28, 29}){
+            // Fibonacci counts over maxLength + 1 byte values need codes of maxLength bits once limited to it
+            vector<unsigned char> text;
+            uint64_t previous = 1, count = 1;
+            for (int byte = 0; byte <= maxLength; byte++){
+                text.insert(text.end(), count, byte * 7);
+                count += previous;
+                previous = count - previous;
+            }
+            shuffle(text.begin(), text.end(), mt19937(maxLength));
+
+            HuffmanTree table;
+            table.maxCodeLength = maxLength;
+            table.addCharFrequencies(text.data(), text.size());
+            table.buildTree();
+            table.assignCanonicalCodes();
+            table.decodeTable.build(table.codes);
+            int expected = *lower_bound(begin(DecodeTable::lengthClasses), end(DecodeTable::lengthClasses), maxLength);
+            bool passed = table.decodeTable.maxLength == maxLength && table.decodeTable.lengthClass() == expected;
+            for (int streams = 1; streams <= 8; streams++){
+                vector<unsigned char> encoded;
+                HuffmanEncoder encoder([&encoded](const unsigned char* data, size_t size){
+                    encoded.insert(encoded.end(), data, data + size);
+                });
+                encoder.tree.blockSize = text.size();
+                encoder.tree.maxCodeLength = maxLength;
+                encoder.tree.streams = streams;
+                encoder.update(text.data(), text.size());
+                encoder.finish();
+                vector<unsigned char> decoded(text.size());
+                HuffmanTree tree;
+                passed &= tree.decode(encoded.data(), encoded.size(), decoded.data(), decoded.size()) && decoded == text;
+            }
+            check("decoders: " + to_string(maxLength) + "-bit codes (length class " + to_string(expected) + "), 1-8 streams", passed);
+        }
+    }
+};
+
+/*
+* Encodes, decodes or verifies many files without prompting, one file per task of a thread pool. Each thread keeps its
+* own HuffmanTree, with its buffers and tables, from one file to the next, and encodes each file on its own thread.
+* Usage: huffmantree -c|-d|-t [-j N] [--stats] [files...]
+*   -c encodes each file to <name>_encoded.txt; -d decodes each file to <name>_decoded.txt; -t checks the header,
+*   index and block checksums of each encoded file without decoding it (see HuffmanTree::verify()).
+*   Corrupt files are reported on standard error.
+*   -j N uses N threads (default: one per hardware thread).
+*   --stats prints the combined Stats of all threads to standard error at the end.
+*   Without files, the file names are read from standard input, one per line, so lists may be any length.
+*/
+struct BatchCommand{
+    /*
+    * Runs the command from command-line arguments.
+    * @param argc The number of arguments.
+    * @param argv The arguments, starting with -c, -d or -t.
+    * @return The exit status: 0 if every file was processed, 1 if some could not be read or written or were corrupt,
+    *     2 for bad usage.
+    */
+    static int run(int argc, char** argv){
+        char mode = argv[0][1];
+        int threads = 0;
+        bool showStats = false;
+        vector<string> files;
+        for (int i = 1; i < argc; i++){
+            string argument = argv[i];
+            if (argument == "--stats"){
+                showStats = true;
+            } else if (argument == "-j" && i + 1 < argc){
+                threads = atoi(argv[++i]);
+            } else if (argument.size() > 2 && argument.compare(0, 2, "-j") == 0){
+                threads = atoi(argument.c_str() + 2);
+            } else {
+                files.push_back(argument);
+            }
+        }
+        if (threads < 0){
+            cerr << "usage: huffmantree -c|-d|-t [-j N] [--stats] [files...]" << endl;
+            return 2;
+        }
+        if (files.empty()){
+            string fileName;
+            while (getline(cin, fileName)){
+                if (!fileName.empty()) files.push_back(fileName);
+            }
+        }
+
+        ThreadPool pool(threads);
+        vector<HuffmanTree> trees(pool.size());
+        for (HuffmanTree& tree: trees){
+            tree.threads = 1; // the pool already runs one file per thread
+        }
+        atomic<size_t> failures{0};
+        mutex errors;
+        Stats stats;
+        {
+            STATS(PhaseTimer timer(stats, Stats::total));
+            pool.run(files.size(), [&](size_t i, int worker){
+                if (!ifstream(files[i], ios::binary)){
+                    lock_guard<mutex> guard(errors);
+                    cerr << "huffmantree: cannot open " << files[i] << endl;
+                    failures++;
+                    return;
+                }
+                bool intact = true;
+                trees[worker].writeFailed = false;
+                if (mode == 'c') intact = trees[worker].encode(files[i]);
+                else if (mode == 'd') intact = trees[worker].decode(files[i]);
+                else intact = trees[worker].verify(files[i]);
+                if (trees[worker].writeFailed){
+                    lock_guard<mutex> guard(errors);
+                    cerr << "huffmantree: " << files[i] << ": cannot write " << trees[worker].outputName << endl;
+                    failures++;
+                } else if (!intact){
+                    lock_guard<mutex> guard(errors);
+                    cerr << "huffmantree: " << files[i] << " is corrupt";
+                    if (trees[worker].corruptBlocks) cerr << " (" << trees[worker].corruptBlocks << " bad blocks)";
+                    cerr << endl;
+                    failures++;
+                }
+            });
+        }
+        if (showStats){
+            for (const HuffmanTree& tree: trees){
+                stats.add(tree.stats);
+            }
+            stats.print(cerr);
+        }
+        return failures ? 1 : 0;
     }
 };
 
-int main() { 
+int main(int argc, char** argv) { 
+    if (argc > 1 && string(argv[1]) == "--bench") return Benchmark::run(argc - 2, argv + 2);
+    if (argc > 1 && string(argv[1]) == "--selftest") return SelfTest::run();
+    if (argc > 1 && (string(argv[1]) == "-c" || string(argv[1]) == "-d" || string(argv[1]) == "-t")) return BatchCommand::run(argc - 1, argv + 1);
+    bool showStats = argc > 1 && string(argv[1]) == "--stats"; // print the Stats of the operation after it
 
     string fileName;
     ifstream input;
@@ -263,7 +5258,7 @@ int main() {
     // get the file name
     do {
         cout << "Enter a file name: ";
-        getline(cin, fileName);
+        if (!getline(cin, fileName)) return 1; // end of input
         input.open(fileName);
 
         if (!input.is_open()){
@@ -278,30 +5273,60 @@ int main() {
         cout << setfill('#') << setw(10) << ' ' << "Menu: " << setfill('#') << setw(10) << ' ' << endl
             << "1: Encode" << endl
             << "2: Decode" << endl
-            << "Would you like to encode or decode? Option: ";
-        cin >> option;
+            << "3: Verify" << endl
+            << "Would you like to encode, decode or verify? Option: ";
+        if (!(cin >> option) && cin.eof()) return 1; // end of input
 
-        if (cin.fail() || option != 1 || option != 2){
+        if (cin.fail() || option < 1 || option > 3){
             cin.clear(); 
             cin.ignore(numeric_limits<streamsize>::max(), '\n'); 
             cout << "Invalid input." << endl << endl;
+            option = 0;
         }
-    } while (!option || option > 2);
+    } while (option < 1 || option > 3);
 
     // perform the operation
     switch(option){
         case 1: // encode
-            tree.encode(fileName);
+            if (!tree.encode(fileName)){
+                cout << "Error writing " << tree.outputName << "." << endl;
+                return 1;
+            }
             cout << "Encoding complete." << endl;
+            if (tree.lengthLimitCost){
+                cout << "Limiting codes to " << tree.maxCodeLength << " bits cost " << tree.lengthLimitCost << " bits ("
+                    << fixed << setprecision(3) << 100.0 * tree.lengthLimitCost / (8 * tree.encodedLength)
+                    << "% of the output)." << endl;
+            }
             break;
         case 2: // decode
-            tree.decode(fileName);
-            cout << "Decoding complete." << endl;
+            if (tree.decode(fileName)){
+                cout << "Decoding complete." << endl;
+            } else if (tree.writeFailed){
+                cout << "Error writing " << tree.outputName << "." << endl;
+                return 1;
+            } else {
+                cout << "Decoding complete, but the file is corrupt; damaged blocks were decoded as zeros." << endl;
+            }
+            break;
+        case 3: // verify
+            if (tree.verify(fileName)){
+                cout << "The file is intact." << endl;
+            } else if (tree.corruptBlocks){
+                cout << "The file is corrupt: " << tree.corruptBlocks << " blocks are damaged." << endl;
+            } else {
+                cout << "The file is corrupt: its header or block index is damaged." << endl;
+            }
             break;
     }
+    if (showStats) tree.stats.print(cout);
 
     return 0;
 
-    // rm -f lorem_encoded.txt & rm -f lorem_encoded_decoded.txt & rm -f huffmantree & g++ ./huffmantree.cpp -o ./huffmantree
+    // rm -f lorem_encoded.txt & rm -f lorem_encoded_decoded.txt & rm -f huffmantree & g++ -O2 -pthread ./huffmantree.cpp -o ./huffmantree
     // ./huffmantree
+    // ./huffmantree --bench --json lorem.txt
+    // ./huffmantree -c -j 8 lorem.txt && ./huffmantree -d --stats lorem_encoded.txt
+    // ./huffmantree -t lorem_encoded.txt
+    // ./huffmantree --selftest
 }